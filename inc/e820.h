@@ -0,0 +1,36 @@
+#ifndef JOS_INC_E820_H
+#define JOS_INC_E820_H
+
+// The BIOS memory map, as returned by int 0x15, eax = 0xE820.
+// The boot loader collects it in real mode and leaves it at physical
+// address E820_MAP, below the boot sector, for i386_detect_memory().
+
+#define E820_MAP	0x8000
+#define E820_MAGIC	0x534D4150U	/* "SMAP", also the BIOS signature */
+#define E820_MAX	32		/* entries kept, the rest is dropped */
+#define E820_ENTSIZE	20
+
+// Entry types
+#define E820_RAM	1	// usable
+#define E820_RESERVED	2
+#define E820_ACPI	3	// reclaimable once ACPI tables are read
+#define E820_NVS	4
+#define E820_UNUSABLE	5	// bad memory
+
+#ifndef __ASSEMBLER__
+
+struct E820Entry {
+	uint64_t addr;
+	uint64_t len;
+	uint32_t type;
+} __attribute__((packed));
+
+struct E820Map {
+	uint32_t magic;		// E820_MAGIC if the boot loader got a map
+	uint32_t nr;
+	struct E820Entry entries[E820_MAX];
+};
+
+#endif /* !__ASSEMBLER__ */
+
+#endif /* !JOS_INC_E820_H */
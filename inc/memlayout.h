@@ -23,6 +23,8 @@
  *                                                    kernel/user
  *
  *    4 Gig -------->  +------------------------------+
+ *                     |   Temporary High Mappings    | RW/--  PTSIZE
+ *    KMAPBASE ----->  +------------------------------+ 0xffc00000
  *                     |                              | RW/--
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
  *                     :              .               :
@@ -48,16 +50,16 @@
  * ULIM, MMIOBASE -->  +------------------------------+ 0xef800000
  *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
  *    UVPT      ---->  +------------------------------+ 0xef400000
- *                     |          RO PAGES            | R-/R-  PTSIZE
- *    UPAGES    ---->  +------------------------------+ 0xef000000
+ *                     |          RO PAGES            | R-/R-  UPAGES_SIZE
+ *    UPAGES    ---->  +------------------------------+ 0xeec00000
  *                     |           RO ENVS            | R-/R-  PTSIZE
- * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
+ * UTOP,UENVS ------>  +------------------------------+ 0xee800000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebff000
+ *                     +------------------------------+ 0xee7ff000
  *                     |       Empty Memory (*)       | --/--  PGSIZE
- *    USTACKTOP  --->  +------------------------------+ 0xeebfe000
+ *    USTACKTOP  --->  +------------------------------+ 0xee7fe000
  *                     |      Normal User Stack       | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebfd000
+ *                     +------------------------------+ 0xee7fd000
  *                     |                              |
  *                     |                              |
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -83,9 +85,14 @@
  */
 
 
-// All physical memory mapped at this address
+// All physical memory mapped at this address, up to KMAPBASE
 #define	KERNBASE	0xF0000000
 
+// The last page table of the address space is kept for temporary mappings
+// of the physical memory beyond KMAPBASE - KERNBASE ("high memory"),
+// see kmap() in kern/pmap.c.
+#define KMAPBASE	(0 - PTSIZE)
+
 // At IOPHYSMEM (640K) there is a 384K hole for I/O.  From the kernel,
 // IOPHYSMEM can be addressed at KERNBASE + IOPHYSMEM.  The hole ends
 // at physical address EXTPHYSMEM.
@@ -108,10 +115,28 @@
  * They are global pages mapped in at env allocation time.
  */
 
-// User read-only virtual page table (see 'uvpt' below)
-#define UVPT		(ULIM - PTSIZE)
-// Read-only copies of the Page structures
-#define UPAGES		(UVPT - PTSIZE)
+// User read-only virtual page table (see 'uvpt' below). It takes a page
+// directory entry for each page of the page directory, 4 of them with PAE,
+// and must be aligned to its size.
+#define UVPTSIZE	(PTSIZE * (NPDENTRIES / NPTENTRIES))
+#define UVPT		((ULIM - UVPTSIZE) & ~(UVPTSIZE - 1))
+// Most physical pages the kernel keeps track of. The metadata of each page
+// sits in low memory: its descriptor, its share of the buddy tree or a
+// free-list link, and its byte of the slab map, up to PAGE_META_MAX bytes
+// in all. With PAE, only as many pages as fit in half of low memory are
+// used, about 16GB. Without it, all the 4GB that can be addressed.
+#define PAGE_META_MAX	32
+#ifdef JOS_PAE
+#define NPAGES_MAX	((KMAPBASE - KERNBASE) / PGSIZE * (PGSIZE / 2 / PAGE_META_MAX))
+#else
+#define NPAGES_MAX	(1 << (32 - PGSHIFT))
+#endif
+
+// Read-only copies of the page descriptors, struct PageDesc or struct
+// PageInfo, room for NPAGES_MAX of them at up to 8 bytes each: 8MB, or
+// 32MB with PAE. Only as much as there are pages is mapped.
+#define UPAGES_SIZE	((NPAGES_MAX * 8 + PTSIZE - 1) & ~(PTSIZE - 1))
+#define UPAGES		(UVPT - UPAGES_SIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
 
@@ -140,13 +165,19 @@
 
 #ifndef __ASSEMBLER__
 
+#ifdef JOS_PAE
+typedef uint64_t pte_t;
+typedef uint64_t pde_t;
+#else
 typedef uint32_t pte_t;
 typedef uint32_t pde_t;
+#endif
 
 #if JOS_USER
 /*
  * The page directory entry corresponding to the virtual address range
- * [UVPT, UVPT + PTSIZE) points to the page directory itself.  Thus, the page
+ * [UVPT, UVPT + PTSIZE) points to the page directory itself (with PAE, the
+ * 4 entries of [UVPT, UVPT + UVPTSIZE) to its 4 pages).  Thus, the page
  * directory is treated as a page table as well as a page directory.
  *
  * One result of treating the page directory as a page table is that all PTEs
@@ -184,5 +215,41 @@ struct PageInfo {
 	uint16_t pp_ref;
 };
 
+/*
+ * What the buddy allocator knows of a physical page, all in one descriptor
+ * so that an operation on the page touches a single cache line: the
+ * descriptors are 8 bytes, or 4 in compact mode, and their array is page
+ * aligned, none of them straddles two lines.  With the buddy allocator,
+ * these are what is mapped at UPAGES instead of struct PageInfo's.
+ *
+ * A few per-page arrays stay outside: struct PageInfo and the bitmap
+ * allocator's counts belong to the other pmem backends, the tree nodes of
+ * tree mode are per block rather than per page, the free-list links of high
+ * pages exist for high memory only, and slab.c keeps its own byte per page,
+ * which wouldn't fit without doubling the descriptors.
+ */
+#ifdef JOS_BUDDY_COMPACT
+/*
+ * With 'make BUDDY_COMPACT=1', the order tags are kept in bitmaps by
+ * kern/pmap.c and the counts are narrower, so that a descriptor is 4 bytes.
+ */
+struct PageDesc {
+	uint16_t pd_ref;	// references, mappings included
+	uint8_t pd_mapcount;	// page table entries mapping the page
+	uint8_t pd_owner;	// who allocated the page
+};
+#define PD_REF_MAX	0xffff
+#define PD_MAPCOUNT_MAX	0xff
+#else
+struct PageDesc {
+	uint32_t pd_ref;	// references, mappings included
+	uint16_t pd_mapcount;	// page table entries mapping the page
+	uint8_t pd_tag;		// free flag and order in free-list mode
+	uint8_t pd_owner;	// who allocated the page
+};
+#define PD_REF_MAX	0xffffffff
+#define PD_MAPCOUNT_MAX	0xffff
+#endif
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
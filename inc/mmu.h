@@ -25,40 +25,70 @@
 // The PDX, PTX, PGOFF, and PGNUM macros decompose linear addresses as shown.
 // To construct a linear address la from PDX(la), PTX(la), and PGOFF(la),
 // use PGADDR(PDX(la), PTX(la), PGOFF(la)).
+//
+// With PAE (make PAE=1), entries are 64 bits long and a page table only
+// holds 512 of them, so there are 4 page directories, chosen by the entries
+// of a page directory pointer table:
+//
+// +2-+----9----+-------9--------+---------12----------+
+// |  |Page Dir.|   Page Table   | Offset within Page  |
+// |  |  Index  |      Index     |                     |
+// +--+---------+----------------+---------------------+
+//  \-- PDX(la) -/ \--- PTX(la) --/ \---- PGOFF(la) ----/
+//
+// JOS keeps the 4 page directories of an address space in consecutive
+// pages, so that PDX() indexes them as a single directory of 2048 entries.
 
 // page number field of address
+#ifdef JOS_PAE
+// physical addresses are 64 bits long, don't truncate them. Cast pointers
+// to uintptr_t first.
+#define PGNUM(la)	((uint32_t) (((uint64_t) (la)) >> PTXSHIFT))
+#else
 #define PGNUM(la)	(((uintptr_t) (la)) >> PTXSHIFT)
+#endif
 
 // page directory index
-#define PDX(la)		((((uintptr_t) (la)) >> PDXSHIFT) & 0x3FF)
+#define PDX(la)		((((uintptr_t) (la)) >> PDXSHIFT) & (NPDENTRIES - 1))
 
 // page table index
-#define PTX(la)		((((uintptr_t) (la)) >> PTXSHIFT) & 0x3FF)
+#define PTX(la)		((((uintptr_t) (la)) >> PTXSHIFT) & (NPTENTRIES - 1))
 
 // offset in page
 #define PGOFF(la)	(((uintptr_t) (la)) & 0xFFF)
 
 // offset in page, when PSE enabled
-#define PGOFF_PSE(la)   (((uintptr_t) (la)) & 0x3fffff)
+#define PGOFF_PSE(la)   (((uintptr_t) (la)) & (PGSIZE_PSE - 1))
 
 // construct linear address from indexes and offset
 #define PGADDR(d, t, o)	((void*) ((d) << PDXSHIFT | (t) << PTXSHIFT | (o)))
 
 // Page directory and page table constants.
+#ifdef JOS_PAE
+#define NPDPENTRIES	4		// page directory pointer table entries
+#define NPDENTRIES	2048		// page directory entries, all 4 directories
+#define NPTENTRIES	512		// page table entries per page table
+#else
 #define NPDENTRIES	1024		// page directory entries per page directory
 #define NPTENTRIES	1024		// page table entries per page table
+#endif
 
 #define PGSIZE		4096		// bytes mapped by a page
 #define PGSHIFT		12		// log2(PGSIZE)
 
+#ifdef JOS_PAE
+#define PGSIZE_PSE      0x200000        // bytes mapped by a large page with PAE
+#define PGSHIFT_PSE     21              // log2(PGSIZE_PSE)
+#else
 #define PGSIZE_PSE      0x400000        // bytes mapped by a page, when PSE enabled
 #define PGSHIFT_PSE     22              // log2(PGSIZE_PSE)
+#endif
 
 #define PTSIZE		(PGSIZE*NPTENTRIES) // bytes mapped by a page directory entry
-#define PTSHIFT		22		// log2(PTSIZE)
+#define PTSHIFT		PGSHIFT_PSE	// log2(PTSIZE)
 
 #define PTXSHIFT	12		// offset of PTX in a linear address
-#define PDXSHIFT	22		// offset of PDX in a linear address
+#define PDXSHIFT	PGSHIFT_PSE	// offset of PDX in a linear address
 
 // Page table/directory entry flags.
 #define PTE_P		0x001	// Present
@@ -79,7 +109,11 @@
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
 // Address in page table or page directory entry
+#ifdef JOS_PAE
+#define PTE_ADDR(pte)	((physaddr_t) (pte) & 0x000FFFFFFFFFF000ULL)
+#else
 #define PTE_ADDR(pte)	((physaddr_t) (pte) & ~0xFFF)
+#endif
 
 // Control Register flags
 #define CR0_PE		0x00000001	// Protection Enable
@@ -96,6 +130,7 @@
 
 #define CR4_PCE		0x00000100	// Performance counter enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
+#define CR4_PAE		0x00000020	// Physical Address Extension
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
 #define CR4_TSD		0x00000004	// Time Stamp Disable
@@ -229,7 +264,7 @@ struct Taskstate {
 	uintptr_t ts_esp2;
 	uint16_t ts_ss2;
 	uint16_t ts_padding3;
-	physaddr_t ts_cr3;	// Page directory base
+	uint32_t ts_cr3;	// Page directory base (physical)
 	uintptr_t ts_eip;	// Saved state from last task switch
 	uint32_t ts_eflags;
 	uint32_t ts_eax;	// More saved state (registers)
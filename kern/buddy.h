@@ -1,17 +1,80 @@
 #ifndef JOS_KERN_BUDDY_H
 #define JOS_KERN_BUDDY_H
 
+// Keep reference counts in the page descriptors instead of the high bits of
+// the leaves. Build with 'make BUDDY_PACKED_REF=1' to measure the packed
+// layout.
+#ifndef JOS_BUDDY_PACKED_REF
+#define BUDDY_SPLIT_REF
+#endif
+
+// Keep the order tags in bitmaps instead of the page descriptors, which
+// shrink to 4 bytes. Build with 'make BUDDY_COMPACT=1'.
+#ifdef JOS_BUDDY_COMPACT
+#define BUDDY_COMPACT
+#endif
+
 // Lowest 5 bits represents max free space under this node, in "log2 + 1" form
 // i.e. 0 for 0, 1 for 1, 2 for 4, 3 for 8, 4 for 16, 5 for 32, etc.
+#ifdef BUDDY_SPLIT_REF
+typedef uint8_t bnode_t;
+#else
 // Higher bits represents the reference count, only 11 bits (0~2047) available
 // as uint16_t. Use uint32_t or even uint64_t if you needs more.
 typedef uint16_t bnode_t;
+#endif
+
+// Nodes are numbered breadth-first, but may be stored in the blocked layout:
+// the tree is cut into subtrees of BUDDY_BLOCK_HEIGHT levels, each of them
+// filling one cache line in breadth-first order, so that a walk between the
+// root and a leaf touches a new line every BUDDY_BLOCK_HEIGHT levels instead
+// of at every level. The cuts are counted from the leaves, only the block
+// of the root may be shorter. Always access nodes through BUDDY_TREE().
+#define BUDDY_BLOCK_BYTES       64
+#define BUDDY_BLOCK_NODES       (BUDDY_BLOCK_BYTES / sizeof(bnode_t))
+#define BUDDY_BLOCK_HEIGHT      (sizeof(bnode_t) == 1 ? 6 : 5)
+#ifdef JOS_PAE
+#define BUDDY_MAX_LEVELS        25 // 2^24 pages, 64GB in a tree
+#else
+#define BUDDY_MAX_LEVELS        21 // BUDDY_MAX_ORDER + 1
+#endif
 
 struct Buddy {
     uint32_t size;
-    bnode_t tree[1]; // maybe we can use "tree[0]" or "tree[]"
+    struct PageDesc *desc; // of each page
+    // levels in the block of the root, 0 for a plain breadth-first array
+    uint32_t top_height;
+    // For each level of the tree in the blocked layout, the slot of its
+    // first node, and the depth of its nodes inside their blocks
+    uint32_t level_base[BUDDY_MAX_LEVELS];
+    uint8_t level_depth[BUDDY_MAX_LEVELS];
+    bnode_t tree[1] __attribute__((aligned(BUDDY_BLOCK_BYTES)));
+};
+
+// Free-list mode: every free block is linked into the list of its order
+// through the first bytes of the block itself, and the first page of every
+// block carries an order tag, so that buddies can be found without the tree.
+struct BuddyLink {
+    struct BuddyLink *prev;
+    struct BuddyLink *next;
 };
 
+#define BUDDY_MAX_ORDER     20 // 2^20 pages, i.e. 4GB
+
+// Order tag of the first page of a block, the other pages are tagged 0
+typedef uint8_t btag_t;
+
+#define BUDDY_TAG_FREE      0x80
+// An allocation trimmed to a size that is not a power of 2 is kept as a few
+// blocks in a row, all but the last one tagged with this
+#define BUDDY_TAG_CONT      0x40
+// A free block that was not merged with its free buddy, see use_buddy_lazy
+#define BUDDY_TAG_LAZY      0x20
+// A single page held by a page magazine, free to kmalloc() but allocated to
+// the buddy system. Free blocks are never continued, so no block has it.
+#define BUDDY_TAG_CACHED    (BUDDY_TAG_FREE | BUDDY_TAG_CONT)
+#define BUDDY_TAG_ORDER(t)  ((t)&0x1f)
+
 #define OUT_OF_MEM          ~0
 #define ADDR_UNAVAIL        ~1
 
@@ -21,7 +84,11 @@ struct Buddy {
 #define RIGHT_CHILD(x)      ((x)*2+2)
 #define PARENT(x)           (((x)-1)/2)
 
-#define SIZE_OF_BUDDY(size) (((size)*2-1)*sizeof(bnode_t) + sizeof(uint32_t))
+
+// Set on an allocated node whose allocation goes on with the next block.
+// Only internal nodes get it, as the blocks of a trimmed allocation shrink
+// from the first to the last and only the last one can be a single page.
+#define BUDDY_NODE_CONT     0x20
 
 // Free space of a node
 #define BUDDY_NODE_SIZE(x)  ((x)&0x1f ? 1<<(((x)&0x1f)-1) : 0)
@@ -29,27 +96,78 @@ struct Buddy {
 // Physical address to node index
 #define PA2NODE(b,pa)       (((pa)>>PGSHIFT)+(b)->size-1)
 
-//#define BUDDY_INC_REF(b,pa) (b)->tree[PA2NODE((b),(pa))] += 0x20
+// floor(log2(x)), x must not be 0
+static inline uint32_t log2_of(uint32_t x)
+{
+    return 31 - __builtin_clz(x);
+}
+
+// Where node is stored in b->tree
+static inline uint32_t buddy_slot(struct Buddy *b, uint32_t node)
+{
+    if (!b->top_height)
+        return node;
+
+    uint32_t level = log2_of(node + 1);
+    uint32_t pos = node + 1 - (1 << level);
+    uint32_t r = b->level_depth[level];
+    return b->level_base[level] + (pos >> r) * BUDDY_BLOCK_NODES + (pos & ((1 << r) - 1));
+}
+
+#define BUDDY_TREE(b,node)  ((b)->tree[buddy_slot((b),(node))])
+
+// Node of the block of 2^order pages beginning at page pn
+#define BUDDY_NODE(b,pn,order)  (((pn)>>(order))+((b)->size>>(order))-1)
+
+#ifdef BUDDY_SPLIT_REF
 
-#define BUDDY_DEC_REF(b,pa) (b)->tree[PA2NODE((b),(pa))] -= 0x20
+#define BUDDY_INC_REF(b,pa) ((b)->desc[PGNUM(pa)].pd_ref++)
 
-#define BUDDY_GET_REF(b,pa) ((b)->tree[PA2NODE((b),(pa))] >> 5)
+#define BUDDY_DEC_REF(b,pa) ((b)->desc[PGNUM(pa)].pd_ref--)
+
+#define BUDDY_GET_REF(b,pa) ((b)->desc[PGNUM(pa)].pd_ref)
 
 // Set reference count to 0, used by checkers
-#define BUDDY_CLR_REF(b,pa) ((b)->tree[PA2NODE((b),(pa))] &= 0x1f)
+#define BUDDY_CLR_REF(b,pa) ((b)->desc[PGNUM(pa)].pd_ref = 0)
+
+#else
+
+//#define BUDDY_INC_REF(b,pa) BUDDY_TREE((b),PA2NODE((b),(pa))) += 0x20
+
+#define BUDDY_DEC_REF(b,pa) BUDDY_TREE((b),PA2NODE((b),(pa))) -= 0x20
 
-void BUDDY_INC_REF(struct Buddy *b, uint32_t pa)
+#define BUDDY_GET_REF(b,pa) (BUDDY_TREE((b),PA2NODE((b),(pa))) >> 5)
+
+// Set reference count to 0, used by checkers
+#define BUDDY_CLR_REF(b,pa) (BUDDY_TREE((b),PA2NODE((b),(pa))) &= 0x1f)
+
+static inline void BUDDY_INC_REF(struct Buddy *b, physaddr_t pa)
 {
     assert(BUDDY_GET_REF(b, pa) <= 2000); // use uint32_t for bnode_t if overflow
-    b->tree[PA2NODE(b, pa)] += 0x20;
+    BUDDY_TREE(b, PA2NODE(b, pa)) += 0x20;
 }
 
+#endif
+
 static inline void buddy_update(struct Buddy *b, uint32_t node)
 {
-    bnode_t l = (b->tree[node * 2 + 1]) & 0x1f;
-    bnode_t r = (b->tree[node * 2 + 2]) & 0x1f;
-    b->tree[node] &= ~0x1f;
-    b->tree[node] |= l > r ? l : r;
+    bnode_t l = BUDDY_TREE(b, LEFT_CHILD(node)) & 0x1f;
+    bnode_t r = BUDDY_TREE(b, RIGHT_CHILD(node)) & 0x1f;
+    BUDDY_TREE(b, node) &= ~0x1f;
+    BUDDY_TREE(b, node) |= l > r ? l : r;
+}
+
+// Update a node whose children are both entirely free blocks of
+// 2^(log_size-2) pages, merging them into one.
+static inline void buddy_merge(struct Buddy *b, uint32_t node, uint32_t log_size)
+{
+    bnode_t l = BUDDY_TREE(b, LEFT_CHILD(node)) & 0x1f;
+    bnode_t r = BUDDY_TREE(b, RIGHT_CHILD(node)) & 0x1f;
+    if (l == log_size - 1 && r == log_size - 1) {
+        BUDDY_TREE(b, node) &= ~0x1f;
+        BUDDY_TREE(b, node) |= log_size;
+    } else
+        buddy_update(b, node);
 }
 
 static inline uint32_t up_to_power_of_2(uint32_t x)
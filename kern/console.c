@@ -7,6 +7,7 @@
 #include <inc/assert.h>
 
 #include <kern/console.h>
+#include <kern/pmap.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -538,8 +539,13 @@ getchar(void)
 {
 	int c;
 
-	while ((c = cons_getc()) == 0)
-		/* do nothing */;
+	// waiting for the user, a good time to set up the rest of the pages,
+	// zero some ahead and look for page tables to promote
+	while ((c = cons_getc()) == 0) {
+		page_init_idle();
+		page_zero_idle();
+		page_promote_idle();
+	}
 	return c;
 }
 
@@ -8,6 +8,8 @@
 #include <kern/console.h>
 #include <kern/pmap.h>
 #include <kern/kclock.h>
+#include <kern/slab.h>
+#include <kern/kmem.h>
 
 
 void
@@ -28,6 +30,11 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	mem_init();
+	// the object caches are built on kmalloc(), i.e. the buddy system
+	if (pmem == &pmem_buddy) {
+		slab_init();
+		kmem_init();
+	}
 
 	// Drop into the kernel monitor.
 	while (1)
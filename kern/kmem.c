@@ -0,0 +1,201 @@
+// Byte-granular kernel heap. Small requests are rounded up to a size class
+// and served from the slab cache of that class, larger ones fall through to
+// the buddy allocator.
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/pmap.h>
+#include <kern/buddy.h>
+#include <kern/slab.h>
+#include <kern/kmem.h>
+
+// Size classes, set up by kmem_init(): each one is 1.25x the one before,
+// rounded up to KMEM_ALIGN, so the smallest ones end up KMEM_ALIGN apart.
+// The last one is KMEM_MAX_SMALL. Tune the ratio with the counters printed
+// by kmem_info().
+#define KMEM_MAX_CLASSES    32
+#define KMEM_GROWTH(size)   ((size) * 5 / 4)
+
+static uint16_t kmem_class_size[KMEM_MAX_CLASSES];
+static uint32_t kmem_nclasses;
+
+struct KmemStat {
+    uint32_t allocs;
+    uint32_t frees;
+    uint64_t requested;     // bytes asked for by callers
+    uint64_t granted;       // bytes actually handed out
+};
+
+static struct SlabCache *kmem_caches[KMEM_MAX_CLASSES];
+static struct KmemStat kmem_stats[KMEM_MAX_CLASSES];
+static struct KmemStat kmem_large;
+
+// Size class of every multiple of KMEM_ALIGN up to KMEM_MAX_SMALL
+static uint8_t kmem_class_index[KMEM_MAX_SMALL / KMEM_ALIGN + 1];
+
+#define KMEM_CLASS(size)    kmem_class_index[ROUNDUP((size), KMEM_ALIGN) / KMEM_ALIGN]
+
+static void check_kmem(void);
+
+void kmem_init(void)
+{
+    uint32_t i, c = 0, size;
+
+    for (size = KMEM_ALIGN; ; size = ROUNDUP(KMEM_GROWTH(size), KMEM_ALIGN)) {
+        assert(kmem_nclasses < KMEM_MAX_CLASSES);
+        kmem_class_size[kmem_nclasses++] = MIN(size, KMEM_MAX_SMALL);
+        if (size >= KMEM_MAX_SMALL) break;
+    }
+
+    for (i = 0; i < kmem_nclasses; i++) {
+        char name[SLAB_NAME_LEN];
+        snprintf(name, sizeof(name), "kmem-%u", kmem_class_size[i]);
+        if (!(kmem_caches[i] = slab_cache_create(name, kmem_class_size[i], KMEM_ALIGN, NULL)))
+            panic("kmem_init: out of memory");
+    }
+
+    for (i = 0; i <= KMEM_MAX_SMALL / KMEM_ALIGN; i++) {
+        while (kmem_class_size[c] < i * KMEM_ALIGN) c++;
+        kmem_class_index[i] = c;
+    }
+
+    check_kmem();
+}
+
+// Allocate size bytes, aligned to KMEM_ALIGN, without initializing.
+// Returns NULL if out of memory.
+void *kmem_alloc(size_t size)
+{
+    struct KmemStat *stat;
+    void *ret;
+
+    if (!kmem_nclasses)
+        panic("kmem_alloc: no kernel heap without the buddy page allocator");
+    if (size == 0) return NULL;
+
+    if (size <= KMEM_MAX_SMALL) {
+        uint32_t c = KMEM_CLASS(size);
+        if (!(ret = slab_alloc(kmem_caches[c])))
+            return NULL;
+        stat = &kmem_stats[c];
+        stat->granted += kmem_class_size[c];
+    } else {
+        uint32_t n = ROUNDUP(size, PGSIZE) / PGSIZE;
+        physaddr_t pa = kmalloc(n);
+        if (pa == OUT_OF_MEM) return NULL;
+        ret = KADDR(pa);
+        stat = &kmem_large;
+        stat->granted += n * PGSIZE;
+    }
+
+    stat->allocs++;
+    stat->requested += size;
+    return ret;
+}
+
+void kmem_free(void *ptr)
+{
+    if (!ptr) return;
+
+    struct SlabCache *cache = slab_cache_of(ptr);
+    if (!cache) {
+        // not from a slab, must be a large block
+        assert(PGOFF(ptr) == 0);
+        kfree(PADDR(ptr));
+        kmem_large.frees++;
+        return;
+    }
+
+    uint32_t c = KMEM_CLASS(cache->size);
+    assert(kmem_caches[c] == cache);
+    slab_free(cache, ptr);
+    kmem_stats[c].frees++;
+}
+
+static void kmem_print_stat(const char *name, struct KmemStat *stat,
+        struct SlabCache *cache)
+{
+    uint32_t waste = stat->granted ?
+        (stat->granted - stat->requested) * 100 / stat->granted : 0;
+    cprintf("%6s %10u %10u %10u  %3u%%", name, stat->allocs, stat->frees,
+            stat->allocs - stat->frees, waste);
+    if (cache && cache->nslabs)
+        cprintf("  %3u%%", cache->nactive * 100 / (cache->nslabs * cache->nobjs));
+    cprintf("\n");
+}
+
+int kmem_info(void)
+{
+    uint32_t i;
+    char name[8];
+
+    if (!kmem_nclasses) {
+        cprintf("The kernel heap needs the buddy page allocator\n");
+        return 0;
+    }
+
+    // waste: internal fragmentation, rounding requests up to their class
+    // util:  active objects in the slabs of the class
+    cprintf(" class     allocs      frees     active  waste  util\n");
+    for (i = 0; i < kmem_nclasses; i++) {
+        snprintf(name, sizeof(name), "%u", kmem_class_size[i]);
+        kmem_print_stat(name, &kmem_stats[i], kmem_caches[i]);
+    }
+    kmem_print_stat("large", &kmem_large, NULL);
+    return 0;
+}
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+static void check_kmem(void)
+{
+    static const size_t sizes[] = {
+        1, 15, 16, 17, 100, 200, 1000, 2047, 2048, 2049, 5000, 3 * PGSIZE + 1,
+    };
+    const uint32_t n = sizeof(sizes) / sizeof(sizes[0]);
+    char *ptrs[sizeof(sizes) / sizeof(sizes[0])];
+    struct KmemStat large = kmem_large;
+    uint32_t i, j;
+
+    assert(kmem_alloc(0) == NULL);
+
+    for (i = 0; i < n; i++) {
+        assert((ptrs[i] = kmem_alloc(sizes[i])));
+        assert((uint32_t) ptrs[i] % KMEM_ALIGN == 0);
+        memset(ptrs[i], i, sizes[i]);
+
+        struct SlabCache *cache = slab_cache_of(ptrs[i]);
+        if (sizes[i] <= KMEM_MAX_SMALL)
+            assert(cache && cache->size >= sizes[i] &&
+                    cache->size < sizes[i] + sizes[i] / 2 + KMEM_ALIGN);
+        else
+            assert(!cache && PGOFF(ptrs[i]) == 0);
+    }
+
+    // nobody overlaps
+    for (i = 0; i < n; i++)
+        for (j = 0; j < sizes[i]; j++)
+            assert(ptrs[i][j] == (char) i);
+
+    assert(kmem_large.allocs - large.allocs == 3);
+
+    // freed memory is reused by the same class
+    kmem_free(ptrs[4]);
+    assert(kmem_alloc(sizes[4] + 1) == ptrs[4]);
+
+    for (i = 0; i < n; i++)
+        kmem_free(ptrs[i]);
+    kmem_free(NULL);
+
+    assert(kmem_large.frees - large.frees == 3);
+    for (i = 0; i < kmem_nclasses; i++)
+        assert(kmem_stats[i].allocs == kmem_stats[i].frees);
+
+    cprintf(COLOR_BLUE"check_kmem() succeeded!\n"COLOR_NONE);
+}
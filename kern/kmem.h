@@ -0,0 +1,19 @@
+#ifndef JOS_KERN_KMEM_H
+#define JOS_KERN_KMEM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Requests up to KMEM_MAX_SMALL bytes are served from size-class slab
+// caches, larger ones go to the buddy system page by page.
+#define KMEM_MAX_SMALL  2048
+#define KMEM_ALIGN      16
+
+void    kmem_init(void);
+void   *kmem_alloc(size_t size);
+void    kmem_free(void *ptr);
+int     kmem_info(void);
+
+#endif /* !JOS_KERN_KMEM_H */
@@ -11,6 +11,8 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/pmap.h>
+#include <kern/slab.h>
+#include <kern/kmem.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -30,6 +32,17 @@ static struct Command commands[] = {
         { "showmappings", "Display memory mapping status", mon_showmappings },
         { "setpage", "Set page permissions", mon_setpage },
         { "memdump", "Show memory content", mon_memdump },
+        { "memmap", "Show the BIOS memory map and the memory being managed", mon_memmap },
+        { "memowners", "Show physical pages by owner", mon_memowners },
+        { "promote", "Collapse full page tables into large pages", mon_promote },
+        { "zoneinfo", "Show free pages and reserves of memory zones", mon_zoneinfo },
+        { "buddyinfo", "Show free blocks, fragmentation and allocator latency", mon_buddyinfo },
+        { "buddybench", "Compare the speed of the buddy tree layouts", mon_buddybench },
+        { "pmembench", "Time single page allocation with the page allocator", mon_pmembench },
+        { "pagemag", "Show or tune per-CPU page magazines", mon_pagemag },
+        { "zeropool", "Show or tune the pool of pre-zeroed pages", mon_zeropool },
+        { "slabinfo", "Show object caches and slab utilization", mon_slabinfo },
+        { "kmeminfo", "Show kernel heap size class counters", mon_kmeminfo },
         { "colortest", "Test colorful output", mon_colortest }
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
@@ -59,6 +72,12 @@ mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 	cprintf("  end    %08x (virt)  %08x (phys)\n", end, end - KERNBASE);
 	cprintf("Kernel executable memory footprint: %dKB\n",
 		ROUNDUP(end - entry, 1024) / 1024);
+	cprintf("Page metadata (%s): %uKB for %u pages, %u.%02u bits per page\n",
+		pmem->name, ROUNDUP(pmem_meta_bytes, 1024) / 1024, npages,
+		pmem_meta_bytes * 8 / npages,
+		(uint32_t) ((uint64_t) pmem_meta_bytes * 800 / npages % 100));
+	if (pmem == &pmem_buddy)
+		buddy_meta_info();
 	return 0;
 }
 
@@ -153,6 +172,89 @@ int mon_memdump(int argc, char **argv, struct Trapframe *tf)
     return 1;
 }
 
+int mon_memmap(int argc, char **argv, struct Trapframe *tf)
+{
+    return mem_map_info();
+}
+
+int mon_memowners(int argc, char **argv, struct Trapframe *tf)
+{
+    return page_owner_info();
+}
+
+int mon_promote(int argc, char **argv, struct Trapframe *tf)
+{
+    return page_promote_all();
+}
+
+int mon_zoneinfo(int argc, char **argv, struct Trapframe *tf)
+{
+    return zone_info();
+}
+
+int mon_buddyinfo(int argc, char **argv, struct Trapframe *tf)
+{
+    if (argc == 1)
+        return buddy_info();
+
+    if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+        buddy_info_reset();
+        return 0;
+    }
+
+    cprintf("usage: buddyinfo [reset]\n");
+    return 1;
+}
+
+int mon_buddybench(int argc, char **argv, struct Trapframe *tf)
+{
+    return buddy_bench();
+}
+
+int mon_pmembench(int argc, char **argv, struct Trapframe *tf)
+{
+    return pmem_bench();
+}
+
+int mon_pagemag(int argc, char **argv, struct Trapframe *tf)
+{
+    if (argc == 1)
+        return page_mag_info();
+
+    if (argc == 4) {
+        uint32_t high = strtol(argv[1], NULL, 0);
+        uint32_t low = strtol(argv[2], NULL, 0);
+        uint32_t batch = strtol(argv[3], NULL, 0);
+        if (page_mag_tune(high, low, batch) == 0)
+            return page_mag_info();
+    }
+
+    cprintf("usage: pagemag [high low batch]\n");
+    return 1;
+}
+
+int mon_zeropool(int argc, char **argv, struct Trapframe *tf)
+{
+    if (argc == 1)
+        return zero_pool_info();
+
+    if (argc == 2 && zero_pool_tune(strtol(argv[1], NULL, 0)) == 0)
+        return zero_pool_info();
+
+    cprintf("usage: zeropool [target]\n");
+    return 1;
+}
+
+int mon_slabinfo(int argc, char **argv, struct Trapframe *tf)
+{
+    return slab_info();
+}
+
+int mon_kmeminfo(int argc, char **argv, struct Trapframe *tf)
+{
+    return kmem_info();
+}
+
 int mon_colortest(int argc, char **argv, struct Trapframe *tf)
 {
     cprintf(COLOR_RED       "Red"
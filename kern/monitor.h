@@ -18,6 +18,17 @@ int mon_backtrace(int argc, char **argv, struct Trapframe *tf);
 int mon_showmappings(int argc, char **argv, struct Trapframe *tf);
 int mon_setpage(int argc, char **argv, struct Trapframe *tf);
 int mon_memdump(int argc, char **argv, struct Trapframe *tf);
+int mon_memmap(int argc, char **argv, struct Trapframe *tf);
+int mon_memowners(int argc, char **argv, struct Trapframe *tf);
+int mon_promote(int argc, char **argv, struct Trapframe *tf);
+int mon_zoneinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_buddyinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_buddybench(int argc, char **argv, struct Trapframe *tf);
+int mon_pmembench(int argc, char **argv, struct Trapframe *tf);
+int mon_pagemag(int argc, char **argv, struct Trapframe *tf);
+int mon_zeropool(int argc, char **argv, struct Trapframe *tf);
+int mon_slabinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_kmeminfo(int argc, char **argv, struct Trapframe *tf);
 int mon_colortest(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
@@ -5,27 +5,357 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/e820.h>
 
 #include <kern/pmap.h>
 #include <kern/kclock.h>
 #include <kern/buddy.h>
 
-static bool use_buddy = true;
+// The physical allocator backend, chosen by name in mem_init(). It lives in
+// the data section so that it can be patched in the kernel image, e.g. with
+// "set var pmem_backend" from gdb before mem_init() runs, to compare the
+// backends on the same image.
+char pmem_backend[PMEM_NAME_LEN] = "buddy";
+const struct PmemOps *pmem;
+size_t pmem_meta_bytes;         // set by pmem->init()
+
+// Store the tree in the blocked layout described in buddy.h instead of a
+// plain breadth-first array. Off by default: finding the slots isn't free,
+// and it only pays off once the tree is too big for the caches. Run
+// buddy_bench() to compare them on your machine, up to the size of the tree
+// in use.
+static bool use_buddy_blocked = false;
+
+// Keep per-order free lists in buddy mode, so that allocating or freeing a
+// block only costs a list operation per split or merge, instead of walking
+// the whole height of the tree.
+static bool use_buddy_lists = true;
+
+// In free-list mode, let kfree() leave up to buddy_lazy_max blocks of each
+// order and zone unmerged with their free buddies, so that freeing and
+// allocating the same block again doesn't merge and split it all the way
+// every time. They are merged when an allocation fails without them.
+// Off by default: no gain over merging right away has been measured yet.
+static bool use_buddy_lazy = false;
+static uint32_t buddy_lazy_max = 16;
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
+size_t npages_low;		// Pages mapped at KERNBASE, the rest is high memory
 static size_t npages_basemem;	// Amount of base memory (in pages)
 
+// Usable RAM as ranges of pages [lo, hi), sorted and merged, from the BIOS
+// memory map if the boot loader got one, otherwise from the NVRAM sizes.
+struct MemRange {
+	uint32_t lo, hi;
+};
+static struct MemRange mem_ranges[E820_MAX];
+static uint32_t mem_nranges;
+static struct E820Map e820;	// as left by the boot loader, for mem_map_info()
+
+// Memory beyond this can't be mapped, and is left out of mem_ranges
+#ifdef JOS_PAE
+#define PHYSADDR_BITS	36
+#else
+#define PHYSADDR_BITS	32
+#endif
+#define PHYSADDR_LIMIT	(1ULL << PHYSADDR_BITS)
+
 // Force disable PSE by set this to false,
 // otherwise detected by i386_detect_memory()
 static bool use_pse = true;
 
+// Collapse full page tables of contiguous pages into large pages from
+// page_promote_idle(). Set this to false to keep every mapping as it is,
+// the monitor's promote command still does it on demand.
+static bool use_page_promote = true;
+static uint32_t page_promotions;
+static uint32_t page_demotions;
+// Page tables set aside by page_promote() for page_remove(), which has to
+// demote a promoted large page even when out of memory
+#define PT_RESERVE  4
+static physaddr_t pt_reserve[PT_RESERVE];
+static uint32_t pt_reserved;
+
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
+#ifdef JOS_PAE
+// What %cr3 points to with PAE, one entry per page of kern_pgdir
+static uint64_t kern_pdpt[NPDPENTRIES] __attribute__((aligned(32)));
+#endif
 struct PageInfo *pages;		// Physical page state array
 static struct PageInfo *page_free_list;	// Free list of physical pages
 
 struct Buddy *pages_b;
+struct PageDesc *page_descs;	// Buddy allocator's state of each page
+
+// Only the metadata of the first PAGE_INIT_CHUNK pages is set up by the
+// backend's init, the rest one chunk at a time by page_init_more(), when an
+// allocation runs out of set up pages or from page_init_idle(). Booting
+// then costs the same whatever the size of memory. Set use_page_init_defer
+// to false to set up everything at boot, and compare the times printed.
+// A chunk must cover the DMA zone, whose reserve comes from the first one.
+#define PAGE_INIT_CHUNK     (1 << 14)   // pages, i.e. 64MB
+
+static bool use_page_init_defer = true;
+static void (*page_init_chunk)(uint32_t lo, uint32_t hi);
+static uint32_t page_init_next;     // first page not set up yet
+static uint32_t page_init_end;      // the backend's pages end here
+static uint32_t page_init_chunks;   // set up after boot
+static uint64_t page_init_cycles;   // spent on them
+
+// Per-CPU cache of free single pages in front of the buddy system.
+// kmalloc(1) pops from it and refills mag_batch pages when it's empty,
+// kfree() of a single page pushes to it and drains down to mag_low pages
+// when it's holding mag_high.
+#define NCPU            1 // no SMP yet, always CPU 0
+#define PAGE_MAG_SIZE   256
+
+struct PageMag {
+    uint32_t count;
+    physaddr_t pages[PAGE_MAG_SIZE];
+
+    uint32_t hits;
+    uint32_t refills;
+    uint32_t drains;
+};
+
+static bool use_page_mags = true;
+static struct PageMag page_mags[NCPU];
+static uint32_t mag_high = 64;
+static uint32_t mag_low = 16;
+static uint32_t mag_batch = 16;
+
+static inline struct PageMag *this_page_mag(void)
+{
+    return &page_mags[0];
+}
+
+// Pages zeroed ahead of time by page_zero_idle(), so that kmalloc_page()
+// with ALLOC_ZERO doesn't have to clear them on the spot. Kept filled up to
+// zero_pool_target pages, and given up only when out of memory.
+#define ZERO_POOL_SIZE  256
+
+struct ZeroPool {
+    uint32_t count;
+    physaddr_t pages[ZERO_POOL_SIZE];
+
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t idles;     // calls to page_zero_idle()
+    uint32_t refills;   // pages zeroed by them
+};
+
+static bool use_zero_pool = true;
+static struct ZeroPool zero_pool;
+static uint32_t zero_pool_target = 32;
+
+// The page of '\0' bytes that page_insert_zero() maps read-only, as many
+// times as needed, until written. Each mapping holds a reference, which
+// only the page descriptors can count that high, so there's none with the
+// packed layout (see BUDDY_SPLIT_REF), nor with the other backends. It's
+// taken from high memory on first use, out of the way of large blocks.
+static physaddr_t zero_page = OUT_OF_MEM;
+static uint32_t zero_page_copies;   // by page_cow_fault()
+
+// Pages allocated for each owner, see ALLOC_OWNER(). The owner of a block is
+// kept in the descriptor of its first page, so that kfree() knows whom to
+// charge back. Pages in the magazines and the zero pool belong to nobody.
+static uint32_t owner_pages[NOWNERS];
+static uint32_t pages_mapped;   // with a non-zero pd_mapcount
+
+static inline void page_account(physaddr_t pa, uint32_t n, int owner)
+{
+    page_descs[PGNUM(pa)].pd_owner = owner;
+    owner_pages[owner] += n;
+}
+
+static inline void page_unaccount(physaddr_t pa, uint32_t n)
+{
+    uint8_t owner = page_descs[PGNUM(pa)].pd_owner;
+    assert(owner_pages[owner] >= n);
+    owner_pages[owner] -= n;
+}
+
+// Slots of the page table at KMAPBASE for temporary mappings of high memory.
+// The first KMAP_ATOMIC slots of each CPU are a stack for kmap_atomic(),
+// the rest are shared by kmap() and stay mapped after kunmap() until they
+// are reused, so that mapping the same page again costs nothing.
+#define KMAP_ATOMIC     16
+#define KMAP_FIRST      (NCPU * KMAP_ATOMIC)    // first slot for kmap()
+#define KMAP_SLOTS      NPTENTRIES
+#define KMAP_HINTS      256
+
+static pte_t *kmap_ptes;    // set in mem_init()
+static uint16_t kmap_count[KMAP_SLOTS];     // users of each kmap() slot
+static uint16_t kmap_hint[KMAP_HINTS];      // last slot of pages, by number
+static uint32_t kmap_hand = KMAP_FIRST;     // next slot to try for reuse
+static uint32_t kmap_atomic_depth[NCPU];
+
+// Physical memory is split into zones by address. kmalloc() prefers the
+// highest zone and only falls back to a lower one while it has more free
+// pages than its reserve, which is kept for kmalloc_constrained() callers
+// that can't use anything above it, like ISA DMA. The high zone is beyond
+// the mapping at KERNBASE, it's only used by kmalloc_page(ALLOC_HIGH).
+#define ZONE_DMA        0   // below 16MB
+#define ZONE_NORMAL     1
+#define ZONE_HIGH       2   // from npages_low
+#define NZONES          3
+
+#define ZONE_DMA_LIMIT  0x1000000
+
+struct Zone {
+    const char *name;
+    uint32_t lo, hi;    // pages [lo, hi)
+    uint32_t reserve;
+    uint32_t nfree;     // free pages in the buddy system
+    uint32_t allocs;
+    uint32_t fails;
+};
+
+static struct Zone zones[NZONES] = {
+    { .name = "DMA" },
+    { .name = "Normal" },
+    { .name = "High" },
+};
+
+static inline uint32_t zone_of(uint32_t pn)
+{
+    if (pn < zones[ZONE_DMA].hi)
+        return ZONE_DMA;
+    return pn < zones[ZONE_NORMAL].hi ? ZONE_NORMAL : ZONE_HIGH;
+}
+
+// Free pages in the buddy system, not counting the magazines
+static inline uint32_t buddy_nfree(void)
+{
+    return zones[ZONE_DMA].nfree + zones[ZONE_NORMAL].nfree + zones[ZONE_HIGH].nfree;
+}
+
+// These variables are set in page_init_b(), used by free-list mode only,
+// but for buddy_max_order, which the tag bitmaps of compact mode use too.
+// Blocks never span two zones, each zone has its own lists.
+static struct BuddyLink *buddy_free_lists[NZONES][BUDDY_MAX_ORDER + 1];
+static uint32_t buddy_max_order;
+
+#ifdef BUDDY_COMPACT
+// The descriptors have no room for the order tags in compact mode, they are
+// kept in bitmaps: a split bit for each block of two pages or more that is
+// cut into smaller ones, a free bit and a flag bit for the first page of
+// each block. That's about 3 bits per page, bounded by npages, but finding
+// the order of a block walks the split bits down from the top.
+static uint32_t *buddy_split_bits[BUDDY_MAX_ORDER + 1];
+static uint32_t *buddy_free_bits;
+// BUDDY_TAG_LAZY on a free block. On an allocated one BUDDY_TAG_CONT, or
+// BUDDY_TAG_CACHED on a single page, which is never continued.
+static uint32_t *buddy_flag_bits;
+
+static inline bool buddy_bit(uint32_t *map, uint32_t i)
+{
+    return map[i / 32] >> (i % 32) & 1;
+}
+
+static inline void buddy_set_bit(uint32_t *map, uint32_t i, bool v)
+{
+    if (v)
+        map[i / 32] |= 1 << (i % 32);
+    else
+        map[i / 32] &= ~(1 << (i % 32));
+}
+
+// Set bits [lo, hi) of map to v
+static void buddy_fill_bits(uint32_t *map, uint32_t lo, uint32_t hi, bool v)
+{
+    for (; lo < hi && lo % 32; lo++)
+        buddy_set_bit(map, lo, v);
+    for (; lo + 32 <= hi; lo += 32)
+        map[lo / 32] = v ? ~0 : 0;
+    for (; lo < hi; lo++)
+        buddy_set_bit(map, lo, v);
+}
+
+// The order tag of page pn. The block holding pn is the first node on the
+// way down that isn't split, the nodes under it are stale.
+static inline btag_t buddy_tag(uint32_t pn)
+{
+    btag_t tag = 0;
+    uint32_t order;
+    if (buddy_bit(buddy_free_bits, pn))
+        tag = BUDDY_TAG_FREE | (buddy_bit(buddy_flag_bits, pn) ? BUDDY_TAG_LAZY : 0);
+    else if (buddy_bit(buddy_flag_bits, pn))
+        tag = BUDDY_TAG_CONT;
+    for (order = buddy_max_order; order > 0; order--)
+        if (!buddy_bit(buddy_split_bits[order], pn >> order))
+            // not the first page of its block
+            return pn & ((1 << order) - 1) ? 0 : tag | order;
+    return tag == BUDDY_TAG_CONT ? BUDDY_TAG_CACHED : tag;
+}
+
+// Tag page pn, the first page of a block of BUDDY_TAG_ORDER(tag) pages.
+// Every node above the block is split, and the block isn't.
+static inline void buddy_set_tag(uint32_t pn, btag_t tag)
+{
+    uint32_t order = BUDDY_TAG_ORDER(tag), k;
+    bool cached = tag == BUDDY_TAG_CACHED;
+
+    buddy_set_bit(buddy_free_bits, pn, (tag & BUDDY_TAG_FREE) && !cached);
+    buddy_set_bit(buddy_flag_bits, pn, tag & (BUDDY_TAG_LAZY | BUDDY_TAG_CONT));
+    for (k = order + 1; k <= buddy_max_order; k++)
+        buddy_set_bit(buddy_split_bits[k], pn >> k, true);
+    if (order)
+        buddy_set_bit(buddy_split_bits[order], pn >> order, false);
+}
+#else
+// The order tag of page pn
+static inline btag_t buddy_tag(uint32_t pn)
+{
+    return page_descs[pn].pd_tag;
+}
+
+// Tag page pn, the first page of a block of BUDDY_TAG_ORDER(tag) pages
+static inline void buddy_set_tag(uint32_t pn, btag_t tag)
+{
+    page_descs[pn].pd_tag = tag;
+}
+#endif
+
+// High pages can't be linked through themselves, their links are kept here
+// instead, one for each page from npages_low on, as struct Page would in a
+// bigger kernel.
+static struct BuddyLink *buddy_high_links;
+
+// Unmerged blocks on each free list, and how they were used
+static uint32_t buddy_lazy[NZONES][BUDDY_MAX_ORDER + 1];
+static uint32_t buddy_lazy_hits;    // allocated as they were
+static uint32_t buddy_lazy_forced;  // merged because an allocation failed
+
+// Latency of the allocator entry points in cycles, bucketed by log2 so that
+// recording one costs two rdtsc and a few increments, cheap enough to keep
+// on all the time. Bucket i counts the calls that took [2^i, 2^(i+1)) cycles.
+#define LAT_BUCKETS     32
+
+struct LatHist {
+    const char *name;
+    uint32_t count;
+    uint64_t cycles;
+    uint32_t buckets[LAT_BUCKETS];
+};
+
+static struct LatHist lat_kmalloc = { .name = "kmalloc" };
+static struct LatHist lat_kfree = { .name = "kfree" };
+static struct LatHist lat_pgdir_walk = { .name = "pgdir_walk" };
+
+static struct LatHist *lat_hists[] = { &lat_kmalloc, &lat_kfree, &lat_pgdir_walk };
+
+#define NLAT_HISTS      (sizeof(lat_hists) / sizeof(lat_hists[0]))
+
+static inline void lat_record(struct LatHist *h, uint64_t start)
+{
+    uint32_t cycles = read_tsc() - start;
+    h->count++;
+    h->cycles += cycles;
+    h->buckets[log2_of(cycles | 1)]++;
+}
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -37,27 +367,108 @@ nvram_read(int r)
 	return mc146818_read(r) | (mc146818_read(r + 1) << 8);
 }
 
+// Add pages [lo, hi) to mem_ranges, keeping them sorted and merged.
+static void
+mem_range_add(uint32_t lo, uint32_t hi)
+{
+	uint32_t i, j;
+
+	if (lo >= hi)
+		return;
+	for (i = 0; i < mem_nranges && mem_ranges[i].hi < lo; i++)
+		/* do nothing */;
+	if (i < mem_nranges && mem_ranges[i].lo <= hi) {
+		// overlaps or touches range i, and maybe the ones after it
+		mem_ranges[i].lo = MIN(mem_ranges[i].lo, lo);
+		mem_ranges[i].hi = MAX(mem_ranges[i].hi, hi);
+		for (j = i + 1; j < mem_nranges && mem_ranges[j].lo <= mem_ranges[i].hi; j++)
+			mem_ranges[i].hi = MAX(mem_ranges[i].hi, mem_ranges[j].hi);
+		memmove(&mem_ranges[i + 1], &mem_ranges[j],
+			(mem_nranges - j) * sizeof(struct MemRange));
+		mem_nranges -= j - i - 1;
+		return;
+	}
+	if (mem_nranges == E820_MAX)
+		return;		// can't happen, one range per entry at most
+	memmove(&mem_ranges[i + 1], &mem_ranges[i],
+		(mem_nranges - i) * sizeof(struct MemRange));
+	mem_ranges[i].lo = lo;
+	mem_ranges[i].hi = hi;
+	mem_nranges++;
+}
+
+// Take the usable entries of the BIOS memory map, if the boot loader left
+// one. Returns false if there is none.
+static bool
+e820_detect(void)
+{
+	// npages isn't known yet, so KADDR() can't be used
+	struct E820Map *map = (struct E820Map *) (E820_MAP + KERNBASE);
+	uint32_t i;
+
+	if (map->magic != E820_MAGIC || map->nr == 0 || map->nr > E820_MAX)
+		return false;
+	e820 = *map;
+
+	for (i = 0; i < e820.nr; i++) {
+		struct E820Entry *e = &e820.entries[i];
+		// ROUNDUP() and ROUNDDOWN() truncate to 32 bits
+		uint64_t lo = (e->addr + PGSIZE - 1) & ~(uint64_t) (PGSIZE - 1);
+		uint64_t hi = (e->addr + e->len) & ~(uint64_t) (PGSIZE - 1);
+
+		// pages beyond PHYSADDR_LIMIT can't be addressed
+		if (e->type != E820_RAM || lo >= PHYSADDR_LIMIT)
+			continue;
+		hi = MIN(hi, PHYSADDR_LIMIT);
+		if (lo < hi)
+			mem_range_add(lo >> PGSHIFT, hi >> PGSHIFT);
+	}
+	return mem_nranges > 0;
+}
+
 static void
 i386_detect_memory(void)
 {
-	size_t npages_extmem;
+	const char *source = "BIOS-e820";
+
+	if (!e820_detect()) {
+		size_t npages_extmem;
+
+		// Use CMOS calls to measure available base & extended memory.
+		// (CMOS calls return results in kilobytes.)
+		source = "NVRAM";
+		npages_basemem = (nvram_read(NVRAM_BASELO) * 1024) / PGSIZE;
+		npages_extmem = (nvram_read(NVRAM_EXTLO) * 1024) / PGSIZE;
+		mem_range_add(0, npages_basemem);
+		mem_range_add(EXTPHYSMEM / PGSIZE, EXTPHYSMEM / PGSIZE + npages_extmem);
+	}
 
-	// Use CMOS calls to measure available base & extended memory.
-	// (CMOS calls return results in kilobytes.)
-	npages_basemem = (nvram_read(NVRAM_BASELO) * 1024) / PGSIZE;
-	npages_extmem = (nvram_read(NVRAM_EXTLO) * 1024) / PGSIZE;
+	if (!mem_nranges)
+		panic("i386_detect_memory: no usable memory");
 
-	// Calculate the number of physical pages available in both base
-	// and extended memory.
-	if (npages_extmem)
-		npages = (EXTPHYSMEM / PGSIZE) + npages_extmem;
-	else
-		npages = npages_basemem;
+	if (mem_ranges[mem_nranges - 1].hi > NPAGES_MAX) {
+		cprintf("Physical memory: only the first %uK can be tracked in low memory\n",
+			NPAGES_MAX * (PGSIZE / 1024));
+		while (mem_ranges[mem_nranges - 1].lo >= NPAGES_MAX)
+			mem_nranges--;
+		mem_ranges[mem_nranges - 1].hi = MIN(mem_ranges[mem_nranges - 1].hi, NPAGES_MAX);
+	}
 
-	cprintf("Physical memory: %uK available, base = %uK, extended = %uK\n",
-		npages * PGSIZE / 1024,
-		npages_basemem * PGSIZE / 1024,
-		npages_extmem * PGSIZE / 1024);
+	// Everything up to the end of the last range, the part of it beyond
+	// the mapping at KERNBASE is high memory.
+	npages = mem_ranges[mem_nranges - 1].hi;
+	npages_low = MIN(npages, PGNUM(KMAPBASE - KERNBASE));
+	npages_basemem = 0;
+	if (mem_ranges[0].lo == 0)
+		npages_basemem = MIN(mem_ranges[0].hi, PGNUM(IOPHYSMEM));
+
+	cprintf("Physical memory: %uK available, base = %uK, high = %uK, from %s\n",
+		npages * (PGSIZE / 1024),
+		npages_basemem * (PGSIZE / 1024),
+		(npages - npages_low) * (PGSIZE / 1024), source);
+#ifdef JOS_PAE
+	cprintf("PAE paging, %u-bit physical addresses\n", PHYSADDR_BITS);
+#endif
 
         if (!use_pse) return;
 
@@ -76,16 +487,31 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void pgdir_prealloc(pde_t *pgdir, uintptr_t va, size_t size);
+static uint32_t buddy_coalesce(uint32_t z);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
 static void check_page_alloc_b();
-static void check_kern_pgdir(void);
-static void check_kern_pgdir_b();
+static void check_buddy_free_lists();
+static void check_kmalloc_trim();
+static void check_kmalloc_constrained();
+static void check_zero_pool();
+static void check_kmalloc_bulk();
+static void check_page_owners();
+static void check_buddy_lazy();
+#ifdef BUDDY_COMPACT
+static void check_buddy_compact();
+#endif
+static void check_kern_pgdir(void *meta, size_t upages_bytes);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_b();
+static void check_page_large();
+static void check_page_promote();
+static void check_zero_page();
 static void check_page_installed_pgdir(void);
-static void check_page_installed_pgdir_b();
+static void check_kmap(void);
+static void check_highmem(void);
 
 static physaddr_t va2pa(pde_t *pgdir, uintptr_t va);
 
@@ -120,46 +546,14 @@ boot_alloc(uint32_t n)
 	// Allocate a chunk large enough to hold 'n' bytes, then update
 	// nextfree.  Make sure nextfree is kept aligned
 	// to a multiple of PGSIZE.
+	// Anything in low memory will do, entry_pgdir maps all of it.
         void *ret = nextfree;
         nextfree += ROUNDUP(n, PGSIZE);
-        if (PADDR(nextfree) > npages * PGSIZE)
+        if (PADDR(nextfree) > npages_low * PGSIZE)
             panic("boot_alloc out of memory!\n");
 	return ret;
 }
 
-// Similar to mem_init(), using buddy system
-void mem_init_b()
-{
-    uint32_t cr0;
-    size_t n;
-    i386_detect_memory();
-
-    kern_pgdir = (pde_t*)boot_alloc(PGSIZE);
-    memset(kern_pgdir, 0, PGSIZE);
-
-    kern_pgdir[PDX(UVPT)] = PADDR(kern_pgdir) | PTE_U | PTE_P;
-
-    page_init_b();
-
-    check_page_alloc_b();
-    check_page_b();
-
-    boot_map_region(kern_pgdir, UPAGES, PTSIZE, PADDR(pages_b), PTE_U);
-    boot_map_region(kern_pgdir, KSTACKTOP - KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W);
-    boot_map_region(kern_pgdir, KERNBASE, -KERNBASE, 0, PTE_W | (use_pse ? PTE_PS : 0));
-
-    check_kern_pgdir_b();
-
-    lcr3(PADDR(kern_pgdir));
-
-    cr0 = rcr0();
-    cr0 |= CR0_PE|CR0_PG|CR0_AM|CR0_WP|CR0_NE|CR0_MP;
-    cr0 &= ~(CR0_TS|CR0_EM);
-    lcr0(cr0);
-
-    check_page_installed_pgdir_b();
-}
-
 static inline void fix_pages()
 {
     struct PageInfo *pp, *pp1, *pp2;
@@ -174,6 +568,22 @@ static inline void fix_pages()
     page_free_list = pp1;
 }
 
+static const struct PmemOps *pmem_backends[] = { &pmem_buddy, &pmem_list, &pmem_bitmap };
+
+#define NPMEM_BACKENDS  (sizeof(pmem_backends) / sizeof(pmem_backends[0]))
+
+static void pmem_select(void)
+{
+    int i;
+    for (i = 0; i < NPMEM_BACKENDS; i++)
+        if (strcmp(pmem_backends[i]->name, pmem_backend) == 0) {
+            pmem = pmem_backends[i];
+            cprintf("Physical page allocator: %s\n", pmem->name);
+            return;
+        }
+    panic("mem_init: unknown page allocator %s", pmem_backend);
+}
+
 // Set up a two-level page table:
 //    kern_pgdir is its linear (virtual) address of the root
 //
@@ -186,13 +596,11 @@ static inline void fix_pages()
 void
 mem_init(void)
 {
-        if (use_buddy) {
-            mem_init_b();
-            return;
-        }
-
 	uint32_t cr0;
-	size_t n;
+	size_t n, upages_bytes;
+	void *meta;
+
+	pmem_select();
 
 	// Find out how much memory the machine has (npages & npages_basemem).
 	i386_detect_memory();
@@ -202,8 +610,12 @@ mem_init(void)
 
 	//////////////////////////////////////////////////////////////////////
 	// create initial page directory.
-	kern_pgdir = (pde_t *) boot_alloc(PGSIZE);
-	memset(kern_pgdir, 0, PGSIZE);
+	kern_pgdir = (pde_t *) boot_alloc(NPDENTRIES * sizeof(pde_t));
+	memset(kern_pgdir, 0, NPDENTRIES * sizeof(pde_t));
+#ifdef JOS_PAE
+	for (n = 0; n < NPDPENTRIES; n++)
+		kern_pdpt[n] = (PADDR(kern_pgdir) + n * PGSIZE) | PTE_P;
+#endif
 
 	//////////////////////////////////////////////////////////////////////
 	// Recursively insert PD in itself as a page table, to form
@@ -212,42 +624,37 @@ mem_init(void)
 	// following line.)
 
         // FIXME: Is this OK with Page Size Extension?
+	// With PAE, each page of kern_pgdir takes one entry.
 	// Permissions: kernel R, user R
-	kern_pgdir[PDX(UVPT)] = PADDR(kern_pgdir) | PTE_U | PTE_P;
-
-	//////////////////////////////////////////////////////////////////////
-	// Allocate an array of npages 'struct PageInfo's and store it in 'pages'.
-	// The kernel uses this array to keep track of physical pages: for
-	// each physical page, there is a corresponding struct PageInfo in this
-	// array.  'npages' is the number of physical pages in memory.  Use memset
-	// to initialize all fields of each struct PageInfo to 0.
-        pages = boot_alloc(npages * sizeof(struct PageInfo));
-        memset(pages, 0, npages * sizeof(struct PageInfo));
+	for (n = 0; n < UVPTSIZE / PTSIZE; n++)
+		kern_pgdir[PDX(UVPT) + n] = (PADDR(kern_pgdir) + n * PGSIZE) | PTE_U | PTE_P;
 
 	//////////////////////////////////////////////////////////////////////
-	// Now that we've allocated the initial kernel data structures, we set
-	// up the list of free physical pages. Once we've done so, all further
-	// memory management will go through the page_* functions. In
-	// particular, we can now map memory using boot_map_region
-	// or page_insert
-	page_init();
-
-        // FIXME: panic if not re-order the list
-        //fix_pages();
-	check_page_free_list(1);
-	check_page_alloc();
-	check_page();
+	// Set up the physical page allocator, which allocates its metadata
+	// with boot_alloc(). Once we've done so, all further memory
+	// management will go through pmem. In particular, we can now map
+	// memory using boot_map_region or page_insert. The free lists of the
+	// buddy system are linked through the free pages, which entry_pgdir
+	// maps like the rest of low memory. Checks that write to free pages
+	// wait for pmem->check, once kern_pgdir is installed.
+	meta = pmem->init(&pmem_meta_bytes);
 
 	//////////////////////////////////////////////////////////////////////
 	// Now we set up virtual memory
 
 	//////////////////////////////////////////////////////////////////////
-	// Map 'pages' read-only by the user at linear address UPAGES
+	// Map the page metadata read-only by the user at linear address UPAGES
 	// Permissions:
 	//    - the new image at UPAGES -- kernel R, user R
 	//      (ie. perm = PTE_U | PTE_P)
-	//    - pages itself -- kernel RW, user NONE
-        boot_map_region(kern_pgdir, UPAGES, PTSIZE, PADDR(pages), PTE_U);
+	//    - the metadata itself -- kernel RW, user NONE
+	// Of the buddy allocator, only the descriptors are shown, not the tree
+	// or the bitmaps after them. UPAGES_SIZE has room for NPAGES_MAX of
+	// either kind of descriptor.
+	static_assert(sizeof(struct PageDesc) <= 8 && sizeof(struct PageInfo) <= 8);
+	upages_bytes = pmem == &pmem_buddy ? npages * sizeof(struct PageDesc) : pmem_meta_bytes;
+	assert(upages_bytes <= UPAGES_SIZE);
+        boot_map_region(kern_pgdir, UPAGES, ROUNDUP(upages_bytes, PGSIZE), PADDR(meta), PTE_U);
 
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
@@ -263,18 +670,22 @@ mem_init(void)
 
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE.
-	// Ie.  the VA range [KERNBASE, 2^32) should map to
-	//      the PA range [0, 2^32 - KERNBASE)
-	// We might not have 2^32 - KERNBASE bytes of physical memory, but
-	// we just set up the mapping anyway.
+	// Ie.  the VA range [KERNBASE, KMAPBASE) should map to
+	//      the PA range [0, KMAPBASE - KERNBASE)
+	// We might not have KMAPBASE - KERNBASE bytes of physical memory, but
+	// we just set up the mapping anyway. Whatever is beyond is high memory.
 	// Permissions: kernel RW, user NONE
-        //boot_map_region(kern_pgdir, KERNBASE, -KERNBASE, 0, PTE_W);
-        boot_map_region(kern_pgdir, KERNBASE, -KERNBASE, 0,
+        boot_map_region(kern_pgdir, KERNBASE, KMAPBASE - KERNBASE, 0,
                 PTE_W | (use_pse ? PTE_PS : 0));
-        // 0xffffffff - KERNBASE + 1 = -1 - KERNBASE + 1 = -KERNBASE
+
+	//////////////////////////////////////////////////////////////////////
+	// Install the page table at KMAPBASE for the temporary mappings of
+	// high memory now, so that kmap() never has to allocate.
+	kmap_ptes = pgdir_walk(kern_pgdir, (void *) KMAPBASE, 1);
+	assert(kmap_ptes);
 
 	// Check that the initial page directory has been set up correctly.
-	check_kern_pgdir();
+	check_kern_pgdir(meta, upages_bytes);
 
 	// Switch from the minimal entry page directory to the full kern_pgdir
 	// page table we just created.	Our instruction pointer should be
@@ -283,9 +694,14 @@ mem_init(void)
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
+#ifdef JOS_PAE
+	lcr3(PADDR(kern_pdpt));
+#else
 	lcr3(PADDR(kern_pgdir));
+#endif
 
-	check_page_free_list(0);
+	if (pmem->check)
+		pmem->check();
 
 	// entry.S set the really important flags in cr0 (including enabling
 	// paging).  Here we configure the rest of the flags that we care about.
@@ -296,6 +712,7 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+	check_kmap();
 }
 
 // --------------------------------------------------------------
@@ -304,6 +721,165 @@ mem_init(void)
 // Pages are reference counted, and free pages are kept on a linked list.
 // --------------------------------------------------------------
 
+static const char *
+e820_type_name(uint32_t type)
+{
+	static const char * const names[] = {
+		[E820_RAM] = "usable",
+		[E820_RESERVED] = "reserved",
+		[E820_ACPI] = "ACPI data",
+		[E820_NVS] = "ACPI NVS",
+		[E820_UNUSABLE] = "unusable",
+	};
+
+	if (type < sizeof(names) / sizeof(names[0]) && names[type])
+		return names[type];
+	return "unknown";
+}
+
+// Print the BIOS memory map, the usable ranges taken from it, how much of
+// them is managed by the page allocator and how much of that is still
+// waiting for page_init_more().
+int
+mem_map_info(void)
+{
+	uint32_t i, usable = 0, managed = 0;
+
+	if (e820.magic == E820_MAGIC) {
+		cprintf("BIOS-e820 map, %u entries:\n", e820.nr);
+		for (i = 0; i < e820.nr; i++) {
+			struct E820Entry *e = &e820.entries[i];
+			cprintf("  %016llx-%016llx  %s\n", e->addr,
+				e->addr + e->len - 1, e820_type_name(e->type));
+		}
+	} else
+		cprintf("No BIOS-e820 map, sizes from NVRAM\n");
+
+	cprintf("Usable ranges:\n");
+	for (i = 0; i < mem_nranges; i++) {
+		cprintf("  %08llx-%08llx  %8uK\n", (uint64_t) mem_ranges[i].lo << PGSHIFT,
+			((uint64_t) mem_ranges[i].hi << PGSHIFT) - 1,
+			(mem_ranges[i].hi - mem_ranges[i].lo) * (PGSIZE / 1024));
+		usable += mem_ranges[i].hi - mem_ranges[i].lo;
+		if (mem_ranges[i].lo < npages)
+			managed += MIN(mem_ranges[i].hi, npages) - mem_ranges[i].lo;
+	}
+	cprintf("Usable %uK, managed %uK in %u pages, %u of them high\n",
+		usable * (PGSIZE / 1024), managed * (PGSIZE / 1024),
+		npages, npages - npages_low);
+	cprintf("Page metadata set up after boot: %u chunks in %llu cycles, %uK to go\n",
+		page_init_chunks, page_init_cycles,
+		(page_init_end - page_init_next) * (PGSIZE / 1024));
+	return 0;
+}
+
+// Call fn on every range of free pages [lo, hi) within pages [from, to):
+// the usable RAM, without page 0, the IO hole, the kernel and what
+// boot_alloc() handed out so far. Every backend's init starts from these,
+// the ones that can't tell high memory apart stop at npages_low.
+static void
+for_each_free_range(uint32_t from, uint32_t to, void (*fn)(uint32_t lo, uint32_t hi))
+{
+	uint32_t hole_lo = PGNUM(IOPHYSMEM);
+	uint32_t hole_hi = PGNUM(PADDR(boot_alloc(0)));
+	uint32_t i;
+
+	for (i = 0; i < mem_nranges; i++) {
+		uint32_t lo = MAX(mem_ranges[i].lo, MAX(from, 1));
+		uint32_t hi = MIN(mem_ranges[i].hi, to);
+
+		if (lo < hole_lo)
+			fn(lo, MIN(hi, hole_lo));
+		lo = MAX(lo, hole_hi);
+		if (lo < hi)
+			fn(lo, hi);
+	}
+}
+
+// Set up the next chunk of pages with page_init_chunk(). Returns how many
+// pages it covered, 0 once all of them are.
+static uint32_t
+page_init_more(void)
+{
+	uint32_t lo = page_init_next, hi;
+	uint64_t start = read_tsc();
+
+	if (lo >= page_init_end)
+		return 0;
+	// set before, so that the chunk can already see its own pages
+	hi = page_init_next = MIN(lo + PAGE_INIT_CHUNK, page_init_end);
+	page_init_chunk(lo, hi);
+
+	page_init_chunks++;
+	page_init_cycles += read_tsc() - start;
+	return hi - lo;
+}
+
+// Called by the backend's init to set up its pages [0, end) with chunk(),
+// only the first chunk right away unless !use_page_init_defer.
+static void
+page_init_deferred(uint32_t end, void (*chunk)(uint32_t lo, uint32_t hi))
+{
+	uint64_t start = read_tsc();
+
+	page_init_chunk = chunk;
+	page_init_next = 0;
+	page_init_end = end;
+	do
+		page_init_more();
+	while (!use_page_init_defer && page_init_next < end);
+
+	cprintf("Page metadata: %uK of %uK set up at boot in %llu cycles\n",
+		page_init_next * (PGSIZE / 1024), end * (PGSIZE / 1024),
+		read_tsc() - start);
+	page_init_chunks = 0;
+	page_init_cycles = 0;
+}
+
+// Keep page_init_more() from setting up any more pages, for the checkers
+// that take all the free memory away and expect allocations to fail.
+// Returns what to pass to page_init_release() when they're done.
+static uint32_t
+page_init_hold(void)
+{
+	uint32_t end = page_init_end;
+	page_init_end = page_init_next;
+	return end;
+}
+
+static void
+page_init_release(uint32_t end)
+{
+	page_init_end = end;
+}
+
+// Set up a chunk of pages in the background. Call it when there's nothing
+// else to do.
+void
+page_init_idle(void)
+{
+	page_init_more();
+}
+
+static void
+page_init_range(uint32_t lo, uint32_t hi)
+{
+	size_t i;
+	for (i = lo; i < hi; i++) {
+		assert(pages[i].pp_ref == 0); // already initialized
+		pages[i].pp_link = page_free_list;
+		page_free_list = &pages[i];
+	}
+}
+
+// Clear the struct PageInfo's of pages [lo, hi) and free the free ones
+static void
+page_init_list_chunk(uint32_t lo, uint32_t hi)
+{
+	memset(pages + lo, 0, (hi - lo) * sizeof(struct PageInfo));
+	for_each_free_range(lo, hi, page_init_range);
+}
+
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
@@ -319,7 +895,7 @@ page_init(void)
 	//     This way we preserve the real-mode IDT and BIOS structures
 	//     in case we ever need them.  (Currently we don't, but...)
 	//  2) The rest of base memory, [PGSIZE, npages_basemem * PGSIZE)
-	//     is free.
+	//     is free, as far as the BIOS memory map says it's RAM.
 	//  3) Then comes the IO hole [IOPHYSMEM, EXTPHYSMEM), which must
 	//     never be allocated.
 	//  4) Then extended memory [EXTPHYSMEM, ...).
@@ -330,39 +906,303 @@ page_init(void)
 	// Change the code to reflect this.
 	// NB: DO NOT actually touch the physical memory corresponding to
 	// free pages!
-        assert(npages_basemem == PGNUM(IOPHYSMEM));
         assert(page_free_list == NULL);
+        page_init_deferred(npages_low, page_init_list_chunk);
+}
 
-	size_t i;
-        for (i = 1; i < npages_basemem; i++) {
-            assert(pages[i].pp_ref == 0); // already initialized
-            pages[i].pp_link = page_free_list;
-            page_free_list = &pages[i];
+// Link of the free block at page pn
+static inline struct BuddyLink *buddy_link(uint32_t pn)
+{
+    if (pn < npages_low)
+        return KADDR(pn << PGSHIFT);
+    return &buddy_high_links[pn - npages_low];
+}
+
+// First page of the free block linked through b
+static inline uint32_t buddy_link_pn(struct BuddyLink *b)
+{
+    if (b >= buddy_high_links && b < buddy_high_links + (npages - npages_low))
+        return npages_low + (b - buddy_high_links);
+    return PGNUM(PADDR(b));
+}
+
+static inline void buddy_push(uint32_t pn, uint32_t order)
+{
+    struct BuddyLink *b = buddy_link(pn);
+    uint32_t z = zone_of(pn);
+    b->prev = NULL;
+    b->next = buddy_free_lists[z][order];
+    if (b->next) b->next->prev = b;
+    buddy_free_lists[z][order] = b;
+    buddy_set_tag(pn, BUDDY_TAG_FREE | order);
+    zones[z].nfree += 1 << order;
+}
+
+static inline void buddy_unlink(struct BuddyLink *b, uint32_t order)
+{
+    uint32_t pn = buddy_link_pn(b);
+    uint32_t z = zone_of(pn);
+    if (buddy_tag(pn) & BUDDY_TAG_LAZY)
+        buddy_lazy[z][order]--;
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        buddy_free_lists[z][order] = b->next;
+    if (b->next) b->next->prev = b->prev;
+    buddy_set_tag(pn, 0);
+    zones[z].nfree -= 1 << order;
+}
+
+// Whether the buddy of the block of 2^order pages at pn is a free block of
+// the same order, that it could be merged with. The tags of the pages not
+// set up yet are garbage.
+static inline bool buddy_buddy_free(uint32_t pn, uint32_t order)
+{
+    uint32_t buddy = pn ^ (1 << order);
+    return order < buddy_max_order && buddy < page_init_next &&
+        (buddy_tag(buddy) & ~BUDDY_TAG_LAZY) == (BUDDY_TAG_FREE | order) &&
+        zone_of(buddy) == zone_of(pn);
+}
+
+// Put the free block of 2^order pages at pn on the free lists, merged with
+// its buddy as long as the buddy is a free block of the same order.
+static void buddy_merge_push(uint32_t pn, uint32_t order)
+{
+    for (; buddy_buddy_free(pn, order); order++) {
+        uint32_t buddy = pn ^ (1 << order);
+        buddy_unlink(buddy_link(buddy), order);
+        pn &= buddy;
+    }
+    buddy_push(pn, order);
+}
+
+// Put pages [lo, hi) on the free lists, as blocks as large as possible,
+// merged with the free pages of the chunks set up before
+static void buddy_free_range(uint32_t lo, uint32_t hi)
+{
+    while (lo < hi) {
+        uint32_t end = MIN(hi, zones[zone_of(lo)].hi);
+        uint32_t order;
+        for (order = 0; order < buddy_max_order; order++)
+            if (lo & (1 << order) || lo + (2 << order) > end) break;
+        buddy_merge_push(lo, order);
+        lo += 1 << order;
+    }
+}
+
+static void zone_init()
+{
+    zones[ZONE_DMA].lo = 0;
+    zones[ZONE_DMA].hi = MIN(npages, PGNUM(ZONE_DMA_LIMIT));
+    zones[ZONE_NORMAL].lo = zones[ZONE_DMA].hi;
+    zones[ZONE_NORMAL].hi = npages_low;
+    zones[ZONE_HIGH].lo = npages_low;
+    zones[ZONE_HIGH].hi = npages;
+}
+
+// Keep a quarter of the DMA zone away from kmalloc(), unless there is
+// nothing else.
+static void zone_set_reserve()
+{
+    if (zones[ZONE_NORMAL].hi > zones[ZONE_NORMAL].lo)
+        zones[ZONE_DMA].reserve = zones[ZONE_DMA].nfree / 4;
+}
+
+// Bytes taken by a tree of size pages, setting up its layout in b unless
+// b is NULL.
+static uint32_t buddy_layout(struct Buddy *b, uint32_t size, bool blocked)
+{
+    uint32_t levels = log2_of(size) + 1;
+    uint32_t nodes = size * 2 - 1;
+    uint32_t top = 0;
+
+    assert(levels <= BUDDY_MAX_LEVELS);
+    if (blocked) {
+        uint32_t level, blocks = 0, row = 0;
+        top = levels % BUDDY_BLOCK_HEIGHT ? levels % BUDDY_BLOCK_HEIGHT : BUDDY_BLOCK_HEIGHT;
+        for (level = 0; level < levels; level++) {
+            uint32_t r = level < top ? level : (level - top) % BUDDY_BLOCK_HEIGHT;
+            // a new row of blocks, one for each node of this level
+            if (r == 0) {
+                row = blocks;
+                blocks += 1 << level;
+            }
+            if (b) {
+                b->level_base[level] = row * BUDDY_BLOCK_NODES + (1 << r) - 1;
+                b->level_depth[level] = r;
+            }
         }
+        nodes = blocks * BUDDY_BLOCK_NODES;
+    }
+
+    if (b) {
+        b->size = size;
+        b->top_height = top;
+    }
+    return offsetof(struct Buddy, tree) + nodes * sizeof(bnode_t);
+}
+
+// Build the internal nodes from the leaves level by level, a node only
+// represents a whole free block when both of its children do.
+static void buddy_tree_build(struct Buddy *b)
+{
+    uint32_t n, i, log_size = 2;
+    for (n = b->size / 2; n; n /= 2, log_size++)
+        for (i = n - 1; i < 2 * n - 1; i++)
+            buddy_merge(b, i, log_size);
+}
+
+// Mark pages [lo, hi) free in the leaves, before building the nodes above
+static void buddy_tree_free_range(uint32_t lo, uint32_t hi)
+{
+    uint32_t i;
+    for (i = lo; i < hi; i++) {
+        BUDDY_TREE(pages_b, pages_b->size - 1 + i) = 1;
+        zones[zone_of(i)].nfree++;
+    }
+}
+
+// Build the subtree of the chunk at page lo, then the path from it up to the
+// root. The nodes above the chunks were cleared by page_init_b(), the leaves
+// of the chunk beyond npages stay allocated.
+static void buddy_tree_init_chunk(uint32_t lo, uint32_t hi)
+{
+    struct Buddy *b = pages_b;
+    uint32_t span = MIN(PAGE_INIT_CHUNK, b->size);
+    uint32_t n, i, node, log_size = 1;
 
-        for (i = PGNUM(PADDR(boot_alloc(0))); i < npages; i++) {
-            assert(pages[i].pp_ref == 0);
-            pages[i].pp_link = page_free_list;
-            page_free_list = &pages[i];
+    for (i = lo; i < lo + span; i++)
+        BUDDY_TREE(b, b->size - 1 + i) = 0;
+    for_each_free_range(lo, hi, buddy_tree_free_range);
+
+    for (n = span / 2; n; n /= 2) {
+        node = BUDDY_NODE(b, lo, log_size);
+        log_size++;
+        for (i = node; i < node + n; i++) {
+            BUDDY_TREE(b, i) = 0;
+            buddy_merge(b, i, log_size);
         }
+    }
+    for (node = BUDDY_NODE(b, lo, log_size - 1); node; node = PARENT(node))
+        buddy_merge(b, PARENT(node), ++log_size);
+}
+
+// Set up pages [lo, hi) of the buddy system, see page_init_more()
+static void buddy_init_chunk(uint32_t lo, uint32_t hi)
+{
+    memset(page_descs + lo, 0, (hi - lo) * sizeof(struct PageDesc));
+#ifdef BUDDY_COMPACT
+    uint32_t order;
+    buddy_fill_bits(buddy_free_bits, lo, hi, false);
+    buddy_fill_bits(buddy_flag_bits, lo, hi, false);
+    // every page is a block of its own until it's freed
+    for (order = 1; order <= buddy_max_order; order++)
+        buddy_fill_bits(buddy_split_bits[order], lo >> order, ((hi - 1) >> order) + 1, true);
+#endif
+    if (!use_buddy_lists) {
+        buddy_tree_init_chunk(lo, hi);
+        return;
+    }
+
+#ifndef BUDDY_SPLIT_REF
+    // the reference counts in the leaves
+    uint32_t i;
+    for (i = lo; i < hi; i++)
+        BUDDY_TREE(pages_b, pages_b->size - 1 + i) = 0;
+#endif
+    for_each_free_range(lo, hi, buddy_free_range);
+}
+
+#ifdef BUDDY_COMPACT
+// Words of a bitmap with a bit for each block of 2^order pages
+static inline uint32_t buddy_bitmap_words(uint32_t order)
+{
+    return ROUNDUP((npages >> order) + 1, 32) / 32;
+}
+
+// Bytes of all the tag bitmaps
+static uint32_t buddy_compact_bytes(void)
+{
+    uint32_t bytes = 2 * buddy_bitmap_words(0) * sizeof(uint32_t), order;
+    for (order = 1; order <= buddy_max_order; order++)
+        bytes += buddy_bitmap_words(order) * sizeof(uint32_t);
+    return bytes;
+}
+
+// Lay the tag bitmaps out at map
+static void buddy_compact_layout(uint32_t *map)
+{
+    uint32_t order;
+
+    buddy_free_bits = map;
+    buddy_flag_bits = map + buddy_bitmap_words(0);
+    map += 2 * buddy_bitmap_words(0);
+    for (order = 1; order <= buddy_max_order; order++) {
+        buddy_split_bits[order] = map;
+        map += buddy_bitmap_words(order);
+    }
 }
+#endif
+
+// Sizes of the parts of the buddy metadata, for buddy_meta_info()
+static uint32_t buddy_desc_bytes, buddy_tree_bytes, buddy_tag_bytes;
 
 void page_init_b()
 {
     uint32_t size = up_to_power_of_2(npages);
-    pages_b = boot_alloc(SIZE_OF_BUDDY(size));
-    memset(pages_b, 0, SIZE_OF_BUDDY(size));
-    pages_b->size = size;
-
-    int i;
-    for (i = 1; i < npages_basemem; i++)
-        pages_b->tree[size - 1 + i] = 1;
+    uint32_t tree_size = buddy_layout(NULL, size, use_buddy_blocked);
+#ifdef BUDDY_SPLIT_REF
+    // The tree is only used for reference counts in free-list mode,
+    // which have moved out of it.
+    if (use_buddy_lists)
+        tree_size = offsetof(struct Buddy, tree);
+#endif
+    // The descriptors come first, they're what UPAGES shows. They, the
+    // tree and the rest are cleared a chunk at a time, see
+    // buddy_init_chunk().
+    uint32_t desc_size = npages * sizeof(struct PageDesc);
+    page_descs = boot_alloc(desc_size);
+    pages_b = boot_alloc(tree_size);
+    memset(pages_b, 0, offsetof(struct Buddy, tree));
+    buddy_layout(pages_b, size, use_buddy_blocked && !use_buddy_lists);
+    pages_b->desc = page_descs;
+    zone_init();
+
+    // the tag bitmaps need it in tree mode too, for the magazines
+    buddy_max_order = MIN(log2_of(size), BUDDY_MAX_ORDER);
+#ifdef BUDDY_COMPACT
+    buddy_tag_bytes = buddy_compact_bytes();
+    buddy_compact_layout(boot_alloc(buddy_tag_bytes));
+#endif
+    buddy_desc_bytes = desc_size;
+    buddy_tree_bytes = tree_size;
+    buddy_meta_info();
+
+    if (use_buddy_lists) {
+        if (npages > npages_low)
+            buddy_high_links = boot_alloc((npages - npages_low) * sizeof(struct BuddyLink));
+    } else {
+        // the roots of the chunks and everything above them
+        uint32_t i;
+        for (i = 0; i < 2 * MAX(size / PAGE_INIT_CHUNK, 1) - 1; i++)
+            BUDDY_TREE(pages_b, i) = 0;
+    }
 
-    for (i = PGNUM(PADDR(boot_alloc(0))); i < npages; i++)
-        pages_b->tree[size - 1 + i] = 1;
+    page_init_deferred(npages, buddy_init_chunk);
+    zone_set_reserve();
+}
 
-    for (i = size - 2; i >= 0; i--)
-        pages_b->tree[i] = pages_b->tree[LEFT_CHILD(i)] + 1;
+// Print the size of each part of the buddy metadata
+void buddy_meta_info(void)
+{
+    cprintf("Buddy metadata: descriptors %uK (%u bytes per page), tree %uK, tag bitmaps %uK\n",
+            ROUNDUP(buddy_desc_bytes, 1024) / 1024, sizeof(struct PageDesc),
+            ROUNDUP(buddy_tree_bytes, 1024) / 1024, ROUNDUP(buddy_tag_bytes, 1024) / 1024);
+#ifdef BUDDY_COMPACT
+    // against the 8-byte descriptors that hold the tags otherwise
+    cprintf("Compact mode saves %uK of descriptors and tags\n",
+            (npages * 8 - buddy_desc_bytes - buddy_tag_bytes) / 1024);
+#endif
 }
 
 //
@@ -380,7 +1220,8 @@ void page_init_b()
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
-    if (!page_free_list) return NULL;
+    while (!page_free_list)
+        if (!page_init_more()) return NULL;
 
     struct PageInfo *ret = page_free_list;
     page_free_list = ret->pp_link;
@@ -392,79 +1233,1252 @@ page_alloc(int alloc_flags)
     return ret;
 }
 
-// Malloc size*PGSIZE bytes of memory, without initializing.
-physaddr_t kmalloc(size_t size)
+// Free-list version of buddy_alloc(). Pops the first block of the zone that
+// holds a block of 2^order pages within pages [lo, hi), gives the unused
+// parts back while splitting it, then trims it down to size.
+static physaddr_t kmalloc_lists(size_t size, uint32_t order,
+        uint32_t z, uint32_t lo, uint32_t hi)
 {
-    uint32_t cur_node = 0;
-    uint32_t cur_size = pages_b->size;
-
-    // is memory enough?
-    if (BUDDY_NODE_SIZE(pages_b->tree[0]) < size)
-        return OUT_OF_MEM;
-
-    // search for "left-most" available block
-    for (; cur_size != size; cur_size /= 2) {
-        if (BUDDY_NODE_SIZE(pages_b->tree[LEFT_CHILD(cur_node)]) >= size)
-            cur_node = LEFT_CHILD(cur_node);
-        else
-            cur_node = RIGHT_CHILD(cur_node);
+    struct BuddyLink *b = NULL;
+    uint32_t cur, pn = 0, start = 0;
+
+    do {
+        for (cur = order; cur <= buddy_max_order && !b; cur++)
+            for (b = buddy_free_lists[z][cur]; b; b = b->next) {
+                pn = buddy_link_pn(b);
+                start = MAX(pn, ROUNDUP(lo, 1 << order));
+                if (start + (1 << order) <= MIN(pn + (1 << cur), hi))
+                    break;
+            }
+    } while (!b && buddy_coalesce(z));
+    if (!b) return OUT_OF_MEM;
+
+    cur--;
+    if (buddy_tag(pn) & BUDDY_TAG_LAZY)
+        buddy_lazy_hits++;
+    buddy_unlink(b, cur);
+
+    // split down to the block at start
+    while (cur > order) {
+        cur--;
+        if (start & (1 << cur)) {
+            buddy_push(pn, cur);
+            pn += 1 << cur;
+        } else
+            buddy_push(pn + (1 << cur), cur);
     }
 
-    // calculate the corresponding page number
-    physaddr_t ret = (cur_node + 1) * cur_size - pages_b->size;
-    pages_b->tree[cur_node] = 0;
-
-    // update parents
-    while (cur_node) {
-        cur_node = PARENT(cur_node);
-        buddy_update(pages_b, cur_node);
+    // Keep the first size pages as blocks of decreasing orders, and free
+    // the rest. The buddy of each freed block is the one in front of it,
+    // which is in use, so there's nothing to merge.
+    uint32_t off;
+    for (off = 0; off < size; off += 1 << cur) {
+        cur = log2_of(size - off);
+        buddy_set_tag(pn + off, cur | (off + (1 << cur) < size ? BUDDY_TAG_CONT : 0));
+    }
+    for (; off < 1 << order; off += 1 << cur) {
+        cur = __builtin_ctz(off);
+        buddy_push(pn + off, cur);
     }
 
-    // page number to physical address
-    return ret << PGSHIFT;
+    return (physaddr_t) pn << PGSHIFT;
 }
 
-//
-// Return a page to the free list.
-// (This function should only be called when pp->pp_ref reaches 0.)
-//
-void
-page_free(struct PageInfo *pp)
+// Find the left-most free node of node_size pages within pages [lo, hi),
+// searching only the subtrees that overlap them. -1 if there's none.
+static int buddy_find(struct Buddy *b, uint32_t node, uint32_t pn,
+        uint32_t cur_size, uint32_t node_size, uint32_t lo, uint32_t hi)
 {
-    // set on allocating
-    assert(pp->pp_link == NULL && pp->pp_ref == 0);
+    if (BUDDY_NODE_SIZE(BUDDY_TREE(b, node)) < node_size ||
+            pn >= hi || pn + cur_size <= lo)
+        return -1;
 
-    pp->pp_link = page_free_list;
-    page_free_list = pp;
+    if (cur_size == node_size)
+        return pn >= lo && pn + node_size <= hi ? node : -1;
+
+    cur_size /= 2;
+    int ret = buddy_find(b, LEFT_CHILD(node), pn, cur_size, node_size, lo, hi);
+    if (ret < 0)
+        ret = buddy_find(b, RIGHT_CHILD(node), pn + cur_size, cur_size, node_size, lo, hi);
+    return ret;
 }
 
-void kfree(physaddr_t pa)
+// Tree version of kmalloc_lists(), returns the first page number.
+static uint32_t buddy_tree_alloc(struct Buddy *b, size_t size, uint32_t order,
+        uint32_t lo, uint32_t hi)
 {
-    uint32_t cur_node = PA2NODE(pages_b, pa);
-    uint32_t log_size = 1;
+    // search for "left-most" available block
+    int cur_node = buddy_find(b, 0, 0, b->size, 1 << order, lo, hi);
+    if (cur_node < 0)
+        return OUT_OF_MEM;
 
-    // On which layer was it allocated?
-    for (; BUDDY_NODE_SIZE(pages_b->tree[cur_node]);
-            cur_node = PARENT(cur_node)) {
-        log_size++;
-        assert(cur_node != 0);
+    // calculate the corresponding page number
+    uint32_t ret = (cur_node + 1 - (b->size >> order)) << order;
+
+    // Only mark the first size pages in use, as blocks of decreasing
+    // orders. The rest of the subtree is still marked free from before.
+    uint32_t off;
+    for (off = 0; off < size; off += 1 << order) {
+        order = log2_of(size - off);
+        cur_node = BUDDY_NODE(b, ret + off, order);
+        BUDDY_TREE(b, cur_node) = off + (1 << order) < size ? BUDDY_NODE_CONT : 0;
+
+        // update parents
+        while (cur_node) {
+            cur_node = PARENT(cur_node);
+            buddy_update(b, cur_node);
+        }
     }
+    return ret;
+}
 
-    pages_b->tree[cur_node] = log_size;
+// Allocate size pages from a block of 2^order pages within pages [lo, hi)
+// of zone z, from the buddy system itself.
+static physaddr_t buddy_alloc_in(size_t size, uint32_t order,
+        uint32_t z, uint32_t lo, uint32_t hi)
+{
+    if (use_buddy_lists)
+        return kmalloc_lists(size, order, z, lo, hi);
 
-    while (cur_node) {
-        cur_node = PARENT(cur_node);
+    uint32_t pn = buddy_tree_alloc(pages_b, size, order, lo, hi);
+    if (pn == OUT_OF_MEM)
+        return OUT_OF_MEM;
+
+    zones[z].nfree -= size;
+
+    // page number to physical address
+    return (physaddr_t) pn << PGSHIFT;
+}
+
+// Allocate size pages, beginning with a block of 2^order pages that ends
+// below page hi. Zones are tried from the highest one down, a zone's
+// reserve is only used if the allocation can't go anywhere above it, and
+// its pages that aren't set up yet come before any of the zones below.
+static physaddr_t buddy_try_alloc_below(size_t size, uint32_t order, uint32_t hi)
+{
+    int z;
+    for (z = NZONES - 1; z >= 0; z--) {
+        struct Zone *zone = &zones[z];
+        uint32_t zone_hi = MIN(zone->hi, hi);
+        if (zone->lo >= zone_hi)
+            continue;
+
+        uint32_t reserve = hi <= zone->hi ? 0 : zone->reserve;
+        do {
+            if (zone->nfree < reserve + size)
+                continue;
+
+            physaddr_t pa = buddy_alloc_in(size, order, z, zone->lo, zone_hi);
+            if (pa != OUT_OF_MEM) {
+                zone->allocs++;
+                return pa;
+            }
+        } while (page_init_next < zone_hi && page_init_more());
+    }
+    return OUT_OF_MEM;
+}
+
+// Same as above, counting the failures. Nothing ends below page 0, and no
+// zone could be blamed for it.
+static physaddr_t buddy_alloc_below(size_t size, uint32_t order, uint32_t hi)
+{
+    if (hi == 0)
+        return OUT_OF_MEM;
+
+    physaddr_t pa = buddy_try_alloc_below(size, order, hi);
+    if (pa == OUT_OF_MEM)
+        zones[zone_of(MIN(hi, npages) - 1)].fails++;
+    return pa;
+}
+
+// Allocate a block of size pages from the buddy system itself, in low
+// memory.
+static physaddr_t buddy_alloc(size_t size)
+{
+    return buddy_alloc_below(size, log2_of(up_to_power_of_2(size - 1)), npages_low);
+}
+
+//
+// Return a page to the free list.
+// (This function should only be called when pp->pp_ref reaches 0.)
+//
+void
+page_free(struct PageInfo *pp)
+{
+    // set on allocating
+    assert(pp->pp_link == NULL && pp->pp_ref == 0);
+
+    pp->pp_link = page_free_list;
+    page_free_list = pp;
+}
+
+// The free-list allocator of struct PageInfo's as a pmem backend
+static void *page_list_init(size_t *meta_bytes)
+{
+	//////////////////////////////////////////////////////////////////////
+	// Allocate an array of npages 'struct PageInfo's and store it in 'pages'.
+	// The kernel uses this array to keep track of physical pages: for
+	// each physical page, there is a corresponding struct PageInfo in this
+	// array.  'npages' is the number of physical pages in memory.  Use memset
+	// to initialize all fields of each struct PageInfo to 0.
+	// page_init() clears them a chunk at a time.
+        *meta_bytes = npages * sizeof(struct PageInfo);
+        pages = boot_alloc(*meta_bytes);
+
+	page_init();
+
+        // FIXME: panic if not re-order the list
+        //fix_pages();
+	check_page_free_list(1);
+	check_page_alloc();
+	check_page();
+	return pages;
+}
+
+static physaddr_t page_list_alloc(int alloc_flags)
+{
+    struct PageInfo *pp = page_alloc(alloc_flags);
+    return pp ? page2pa(pp) : OUT_OF_MEM;
+}
+
+static void page_list_free(physaddr_t pa)
+{
+    page_free(pa2page(pa));
+}
+
+static void page_list_incref(physaddr_t pa)
+{
+    pa2page(pa)->pp_ref++;
+}
+
+static void page_list_decref(physaddr_t pa)
+{
+    page_decref(pa2page(pa));
+}
+
+static uint32_t page_list_lookup(physaddr_t pa)
+{
+    return pa2page(pa)->pp_ref;
+}
+
+static void page_list_check(void)
+{
+    check_page_free_list(0);
+}
+
+const struct PmemOps pmem_list = {
+    .name = "list",
+    .init = page_list_init,
+    .alloc = page_list_alloc,
+    .free = page_list_free,
+    .incref = page_list_incref,
+    .decref = page_list_decref,
+    .lookup = page_list_lookup,
+    .check = page_list_check,
+};
+
+// Bitmap allocator: one bit per page, set for the free ones, in leaf words
+// of 32 pages. Each 4MB region has a mask of its leaf words that have free
+// pages, and the summary a bit for each region that has any, so that the
+// first free page is found with three bit scans. Reference counts are kept
+// in an array beside the bitmap. Only low memory is covered, which the
+// summary can always hold.
+#define BITMAP_REGION_PAGES     NPTENTRIES  // 4MB, 2MB with PAE
+#define BITMAP_REGION_WORDS     (BITMAP_REGION_PAGES / 32)
+#define BITMAP_MAX_REGIONS      NPDENTRIES
+#define BITMAP_SUMMARY_WORDS    (BITMAP_MAX_REGIONS / 32)
+
+static uint32_t bitmap_summary[BITMAP_SUMMARY_WORDS];
+static uint32_t bitmap_masks[BITMAP_MAX_REGIONS];
+static uint32_t bitmap_nsummary;    // summary words covering npages_low
+
+// These variables are set in page_bitmap_init()
+static uint32_t *bitmap_leaves;     // BITMAP_REGION_WORDS per region
+static uint16_t *bitmap_refs;
+static uint32_t bitmap_nfree;
+
+static void check_page_bitmap(void);
+
+static inline bool bitmap_is_free(uint32_t pn)
+{
+    return bitmap_leaves[pn / 32] & (1 << pn % 32);
+}
+
+static void page_bitmap_free(physaddr_t pa)
+{
+    uint32_t pn = PGNUM(pa), w = pn / 32, r = pn / BITMAP_REGION_PAGES;
+
+    assert(!bitmap_is_free(pn) && bitmap_refs[pn] == 0);
+    bitmap_leaves[w] |= 1 << pn % 32;
+    bitmap_masks[r] |= 1 << w % BITMAP_REGION_WORDS;
+    bitmap_summary[r / 32] |= 1 << r % 32;
+    bitmap_nfree++;
+}
+
+// The free page with the lowest address
+static physaddr_t page_bitmap_alloc(int alloc_flags)
+{
+    uint32_t i, r, w, pn;
+
+    do
+        for (i = 0; i < bitmap_nsummary && !bitmap_summary[i]; i++)
+            /* do nothing */;
+    while (i == bitmap_nsummary && page_init_more());
+    if (i == bitmap_nsummary)
+        return OUT_OF_MEM;
+
+    r = i * 32 + __builtin_ctz(bitmap_summary[i]);
+    w = r * BITMAP_REGION_WORDS + __builtin_ctz(bitmap_masks[r]);
+    pn = w * 32 + __builtin_ctz(bitmap_leaves[w]);
+
+    // clear the summary bits of whatever this empties
+    if (!(bitmap_leaves[w] &= ~(1 << pn % 32)) &&
+            !(bitmap_masks[r] &= ~(1 << w % BITMAP_REGION_WORDS)))
+        bitmap_summary[i] &= ~(1 << r % 32);
+    bitmap_nfree--;
+
+    if (alloc_flags & ALLOC_ZERO)
+        memset(KADDR(pn << PGSHIFT), 0, PGSIZE);
+    return pn << PGSHIFT;
+}
+
+static void page_bitmap_free_range(uint32_t lo, uint32_t hi)
+{
+    uint32_t i;
+    for (i = lo; i < hi; i++)
+        page_bitmap_free(i << PGSHIFT);
+}
+
+// Clear the bits and reference counts of pages [lo, hi), then free the
+// free ones, the same pages as page_init()
+static void page_bitmap_init_chunk(uint32_t lo, uint32_t hi)
+{
+    uint32_t w = lo / 32, nw = ROUNDUP(hi, 32) / 32 - w;
+
+    memset(bitmap_leaves + w, 0, nw * sizeof(uint32_t));
+    memset(bitmap_refs + lo, 0, (hi - lo) * sizeof(uint16_t));
+    for_each_free_range(lo, hi, page_bitmap_free_range);
+}
+
+static void *page_bitmap_init(size_t *meta_bytes)
+{
+    uint32_t nregions = ROUNDUP(npages_low, BITMAP_REGION_PAGES) / BITMAP_REGION_PAGES;
+    uint32_t leaf_size = nregions * BITMAP_REGION_WORDS * sizeof(uint32_t);
+    uint32_t ref_size = npages_low * sizeof(uint16_t);
+
+    bitmap_leaves = boot_alloc(leaf_size + ref_size);
+    bitmap_refs = (uint16_t *) ((char *) bitmap_leaves + leaf_size);
+    bitmap_nsummary = ROUNDUP(nregions, 32) / 32;
+    *meta_bytes = leaf_size + ref_size;
+
+    cprintf("Bitmap metadata: bitmap %uK, refcount %uK\n",
+            ROUNDUP(leaf_size, 1024) / 1024, ROUNDUP(ref_size, 1024) / 1024);
+
+    page_init_deferred(npages_low, page_bitmap_init_chunk);
+
+    check_page_bitmap();
+    return bitmap_leaves;
+}
+
+static void page_bitmap_incref(physaddr_t pa)
+{
+    assert(bitmap_refs[PGNUM(pa)] < 0xffff);
+    bitmap_refs[PGNUM(pa)]++;
+}
+
+static void page_bitmap_decref(physaddr_t pa)
+{
+    if (--bitmap_refs[PGNUM(pa)] == 0)
+        page_bitmap_free(pa);
+}
+
+static uint32_t page_bitmap_lookup(physaddr_t pa)
+{
+    return bitmap_refs[PGNUM(pa)];
+}
+
+const struct PmemOps pmem_bitmap = {
+    .name = "bitmap",
+    .init = page_bitmap_init,
+    .alloc = page_bitmap_alloc,
+    .free = page_bitmap_free,
+    .incref = page_bitmap_incref,
+    .decref = page_bitmap_decref,
+    .lookup = page_bitmap_lookup,
+};
+
+// Free-list version of kfree(), merges every block of the allocation with
+// its buddy as long as the buddy is a free block of the same order.
+static uint32_t kfree_lists(physaddr_t pa)
+{
+    uint32_t next = PGNUM(pa);
+    btag_t tag;
+
+    do {
+        uint32_t pn = next;
+        tag = buddy_tag(pn);
+        assert(!(tag & BUDDY_TAG_FREE)); // double free
+        buddy_set_tag(pn, 0);
+
+        uint32_t order = BUDDY_TAG_ORDER(tag);
+        uint32_t z = zone_of(pn);
+        next = pn + (1 << order);
+
+        if (use_buddy_lazy && buddy_lazy[z][order] < buddy_lazy_max &&
+                buddy_buddy_free(pn, order)) {
+            buddy_push(pn, order);
+            buddy_set_tag(pn, buddy_tag(pn) | BUDDY_TAG_LAZY);
+            buddy_lazy[z][order]++;
+        } else
+            buddy_merge_push(pn, order);
+    } while (tag & BUDDY_TAG_CONT);
+    return next - PGNUM(pa);
+}
+
+// Merge the blocks left unmerged in zone z, returns how many there were.
+static uint32_t buddy_coalesce(uint32_t z)
+{
+    uint32_t order, n = 0;
+
+    for (order = 0; order <= buddy_max_order; order++) {
+        struct BuddyLink *b = buddy_free_lists[z][order];
+        while (buddy_lazy[z][order]) {
+            uint32_t pn = buddy_link_pn(b);
+            if (!(buddy_tag(pn) & BUDDY_TAG_LAZY)) {
+                b = b->next;
+                continue;
+            }
+            buddy_unlink(b, order);
+            buddy_merge_push(pn, order);
+            b = buddy_free_lists[z][order];
+            n++;
+        }
+    }
+
+    buddy_lazy_forced += n;
+    return n;
+}
+
+// Free the block of the tree beginning at page pn, returns its number of
+// pages, and whether the allocation goes on after it in *cont.
+static uint32_t buddy_tree_free(struct Buddy *b, uint32_t pn, bool *cont)
+{
+    uint32_t cur_node = BUDDY_NODE(b, pn, 0);
+    uint32_t log_size = 1;
+
+    // On which layer was it allocated?
+    for (; BUDDY_NODE_SIZE(BUDDY_TREE(b, cur_node));
+            cur_node = PARENT(cur_node)) {
         log_size++;
+        assert(cur_node != 0);
+    }
+
+    // the high bits of leaves may hold reference counts instead
+    *cont = log_size > 1 && (BUDDY_TREE(b, cur_node) & BUDDY_NODE_CONT);
+    BUDDY_TREE(b, cur_node) = log_size;
+
+    uint32_t pages = 1 << (log_size - 1);
+    while (cur_node) {
+        cur_node = PARENT(cur_node);
+        log_size++;
+        buddy_merge(b, cur_node, log_size);
+    }
+    return pages;
+}
+
+// Give a block back to the buddy system itself, returns its size in pages.
+static uint32_t buddy_free(physaddr_t pa)
+{
+    if (use_buddy_lists)
+        return kfree_lists(pa);
+
+    uint32_t pn = PGNUM(pa), pages;
+    bool cont;
+    do {
+        pages = buddy_tree_free(pages_b, pn, &cont);
+        zones[zone_of(pn)].nfree += pages;
+        pn += pages;
+    } while (cont);
+    return pn - PGNUM(pa);
+}
+
+// Was the block at pa allocated as a single page?
+static inline bool buddy_is_single(physaddr_t pa)
+{
+    if (use_buddy_lists)
+        return buddy_tag(PGNUM(pa)) == 0;
+    // larger blocks are marked on internal nodes, leaving the leaves free
+    return BUDDY_NODE_SIZE(BUDDY_TREE(pages_b, PA2NODE(pages_b, pa))) == 0;
+}
+
+// Was the block at pa allocated with 2^order pages, or as the first block
+// of a trimmed allocation?
+static inline bool buddy_is_block(physaddr_t pa, uint32_t order)
+{
+    uint32_t pn = PGNUM(pa), k;
+
+    if (use_buddy_lists) {
+        btag_t tag = buddy_tag(pn);
+        return !(tag & BUDDY_TAG_FREE) && BUDDY_TAG_ORDER(tag) == order;
+    }
+    if (pn % (1 << order) ||
+            BUDDY_NODE_SIZE(BUDDY_TREE(pages_b, BUDDY_NODE(pages_b, pn, order))))
+        return false;
+    // the nodes below a block allocated whole are left free
+    for (k = 0; k < order; k++)
+        if (!BUDDY_NODE_SIZE(BUDDY_TREE(pages_b, BUDDY_NODE(pages_b, pn, k))))
+            return false;
+    return true;
+}
+
+// Put a single page in the magazine, tagged so that freeing it again while
+// it's there is caught, whether or not the buddy system keeps tags.
+static inline void page_mag_push(struct PageMag *mag, physaddr_t pa)
+{
+    assert(buddy_tag(PGNUM(pa)) != BUDDY_TAG_CACHED); // double free
+    buddy_set_tag(PGNUM(pa), BUDDY_TAG_CACHED);
+    mag->pages[mag->count++] = pa;
+}
+
+static inline physaddr_t page_mag_pop(struct PageMag *mag)
+{
+    physaddr_t pa = mag->pages[--mag->count];
+    buddy_set_tag(PGNUM(pa), 0);
+    return pa;
+}
+
+// Refill an empty magazine with up to mag_batch pages.
+static void page_mag_refill(struct PageMag *mag)
+{
+    mag->refills++;
+    while (mag->count < mag_batch) {
+        physaddr_t pa = buddy_alloc(1);
+        if (pa == OUT_OF_MEM) break;
+        page_mag_push(mag, pa);
+    }
+}
+
+// Give pages back to the buddy system until there are only 'low' left.
+static void page_mag_drain(struct PageMag *mag, uint32_t low)
+{
+    mag->drains++;
+    while (mag->count > low)
+        buddy_free(page_mag_pop(mag));
+}
+
+// A single page, from the magazine if possible.
+static physaddr_t page_mag_alloc(void)
+{
+    if (!use_page_mags)
+        return buddy_alloc(1);
+
+    struct PageMag *mag = this_page_mag();
+    if (mag->count)
+        mag->hits++;
+    else
+        page_mag_refill(mag);
+
+    return mag->count ? page_mag_pop(mag) : OUT_OF_MEM;
+}
+
+// Give the pages cached by all the magazines and the zero pool back to the
+// buddy system, returns how many there were.
+static uint32_t page_caches_drain(void)
+{
+    uint32_t n = zero_pool.count;
+    int i;
+
+    while (zero_pool.count)
+        buddy_free(zero_pool.pages[--zero_pool.count]);
+    for (i = 0; i < NCPU; i++) {
+        n += page_mags[i].count;
+        page_mag_drain(&page_mags[i], 0);
+    }
+    return n;
+}
+
+// kmalloc() and its kin are the buddy system's own interface, and can't go
+// through pmem: the other backends only hand out single pages, and their
+// metadata isn't the tree or the lists. Catch callers using them anyway.
+static inline void buddy_required(const char *fn)
+{
+    if (pmem != &pmem_buddy)
+        panic("%s: needs the buddy page allocator, not %s", fn,
+              pmem ? pmem->name : "none");
+}
+
+// kmalloc() without charging the pages to anybody
+static physaddr_t kmalloc_block(size_t size)
+{
+    uint64_t start = read_tsc();
+    physaddr_t pa;
+
+    // no block has 0 pages, and its order can't be computed
+    if (size == 0)
+        return OUT_OF_MEM;
+    if (size != 1) {
+        pa = buddy_alloc(size);
+        // the cached single pages may merge into a block large enough
+        if (pa == OUT_OF_MEM && page_caches_drain())
+            pa = buddy_alloc(size);
+    } else {
+        pa = page_mag_alloc();
+
+        // zeroed pages are as good as any when running out of memory
+        if (pa == OUT_OF_MEM && zero_pool.count)
+            pa = zero_pool.pages[--zero_pool.count];
+    }
+
+    lat_record(&lat_kmalloc, start);
+    return pa;
+}
+
+// Malloc size*PGSIZE bytes of memory, without initializing. The size needn't
+// be a power of 2, the pages beyond it are given back to the buddy system
+// right away, and kfree() frees all the pages at once.
+physaddr_t kmalloc(size_t size)
+{
+    buddy_required("kmalloc");
+    physaddr_t pa = kmalloc_block(size);
+    if (pa != OUT_OF_MEM)
+        page_account(pa, size, OWNER_KERNEL);
+    return pa;
+}
+
+// A page of the high zone, OUT_OF_MEM if there's none left.
+static physaddr_t kmalloc_high(void)
+{
+    struct Zone *high = &zones[ZONE_HIGH];
+    physaddr_t pa;
+
+    // set up the chunks below it first if needs be
+    while (!high->nfree)
+        if (!page_init_more())
+            return OUT_OF_MEM;
+    uint64_t start = read_tsc();
+    if ((pa = buddy_alloc_in(1, 0, ZONE_HIGH, high->lo, high->hi)) != OUT_OF_MEM)
+        high->allocs++;
+    lat_record(&lat_kmalloc, start);
+    return pa;
+}
+
+// kmalloc_page() without charging the page to anybody
+static physaddr_t kmalloc_page_block(int alloc_flags)
+{
+    physaddr_t pa;
+
+    if ((alloc_flags & ALLOC_HIGH) && (pa = kmalloc_high()) != OUT_OF_MEM) {
+        if (alloc_flags & ALLOC_ZERO) {
+            void *va = kmap_atomic(pa);
+            memset(va, 0, PGSIZE);
+            kunmap_atomic(va);
+        }
+        return pa;
+    }
+
+    if (!(alloc_flags & ALLOC_ZERO))
+        return kmalloc_block(1);
+
+    if (use_zero_pool && zero_pool.count) {
+        zero_pool.hits++;
+        return zero_pool.pages[--zero_pool.count];
+    }
+
+    pa = kmalloc_block(1);
+    if (pa != OUT_OF_MEM) {
+        zero_pool.misses++;
+        memset(KADDR(pa), 0, PGSIZE);
+    }
+    return pa;
+}
+
+// Allocate a single page, filled with '\0' bytes if (alloc_flags & ALLOC_ZERO),
+// preferably one zeroed in advance. With ALLOC_HIGH, high memory is used
+// first, and zeroed through kmap_atomic(). The page is charged to the owner
+// given by ALLOC_OWNER() in alloc_flags, the kernel heap by default.
+physaddr_t kmalloc_page(int alloc_flags)
+{
+    buddy_required("kmalloc_page");
+    physaddr_t pa = kmalloc_page_block(alloc_flags);
+    if (pa != OUT_OF_MEM)
+        page_account(pa, 1, ALLOC_OWNER_OF(alloc_flags));
+    return pa;
+}
+
+// Charge the single page at pa to another owner
+void page_set_owner(physaddr_t pa, int owner)
+{
+    if (!page_desc(pa))
+        return;
+    page_unaccount(pa, 1);
+    page_account(pa, 1, owner);
+}
+
+// Turn an allocated block of 2^order pages into as many single pages, as if
+// each of them had been allocated by itself.
+static void buddy_split_pages(uint32_t pn, uint32_t order)
+{
+    uint32_t h, i;
+
+#ifdef BUDDY_COMPACT
+    if (use_buddy_lists) {
+        // split all the way down, the nodes above already are
+        for (h = 1; h <= order; h++)
+            buddy_fill_bits(buddy_split_bits[h], pn >> h, (pn >> h) + (1 << (order - h)), true);
+        buddy_fill_bits(buddy_free_bits, pn, pn + (1 << order), false);
+        buddy_fill_bits(buddy_flag_bits, pn, pn + (1 << order), false);
+        return;
+    }
+#endif
+    if (use_buddy_lists) {
+        for (i = 0; i < 1 << order; i++)
+            buddy_set_tag(pn + i, 0);
+        return;
+    }
+
+    // nothing is free under the block, down to the leaves
+    for (h = 0; h < order; h++) {
+        uint32_t node = BUDDY_NODE(pages_b, pn, h);
+        for (i = 0; i < 1 << (order - h); i++)
+            BUDDY_TREE(pages_b, node + i) &= ~0x1f;
+    }
+}
+
+// Allocate n single pages into pas, in ascending order within each block.
+// They are taken a whole block at a time, so that the tree or the lists
+// are only updated once per block instead of once per page. alloc_flags is
+// as for kmalloc_page(), but for ALLOC_HIGH: with ALLOC_ZERO, the zero pool
+// is used up first.
+// Returns how many pages were allocated, fewer than n if out of memory.
+size_t kmalloc_bulk(physaddr_t *pas, size_t n, int alloc_flags)
+{
+    uint32_t order = 31, got = 0, i;
+    int owner = ALLOC_OWNER_OF(alloc_flags);
+
+    buddy_required("kmalloc_bulk");
+
+    if ((alloc_flags & ALLOC_ZERO) && use_zero_pool)
+        for (; got < n && zero_pool.count; got++) {
+            zero_pool.hits++;
+            pas[got] = zero_pool.pages[--zero_pool.count];
+            page_account(pas[got], 1, owner);
+        }
+
+    while (got < n) {
+        physaddr_t pa;
+
+        // larger blocks won't show up again, keep going down
+        order = MIN(order, log2_of(n - got));
+        while ((pa = buddy_try_alloc_below(1 << order, order, npages_low)) == OUT_OF_MEM
+                && order)
+            order--;
+        // the cached single pages are as good as any when running out
+        if (pa == OUT_OF_MEM && page_caches_drain())
+            continue;
+        if (pa == OUT_OF_MEM) {
+            zones[zone_of(npages_low - 1)].fails++;
+            break;
+        }
+
+        buddy_split_pages(PGNUM(pa), order);
+        for (i = 0; i < 1 << order; i++) {
+            if (alloc_flags & ALLOC_ZERO) {
+                zero_pool.misses++;
+                memset(KADDR(pa + i * PGSIZE), 0, PGSIZE);
+            }
+            page_account(pa + i * PGSIZE, 1, owner);
+            pas[got++] = pa + i * PGSIZE;
+        }
+    }
+    return got;
+}
+
+#define KFREE_BULK_BATCH    64
+
+// Free n single pages straight to the buddy system. In tree mode the parents
+// are updated level by level for a batch of pages at a time, and nodes shared
+// by neighboring pages are only updated once, so sorted pages are freed the
+// fastest.
+static void buddy_free_bulk(physaddr_t *pas, size_t n)
+{
+    uint32_t nodes[KFREE_BULK_BATCH];
+    uint32_t i, j, k;
+
+    if (use_buddy_lists) {
+        for (i = 0; i < n; i++) {
+            assert(buddy_is_single(pas[i]));
+            kfree_lists(pas[i]);
+        }
+        return;
+    }
+
+    while (n) {
+        uint32_t m = MIN(n, KFREE_BULK_BATCH), cnt = 0;
+
+        for (i = 0; i < m; i++) {
+            uint32_t node = PA2NODE(pages_b, pas[i]);
+            assert(BUDDY_NODE_SIZE(BUDDY_TREE(pages_b, node)) == 0);
+            BUDDY_TREE(pages_b, node) = 1;
+            zones[zone_of(PGNUM(pas[i]))].nfree++;
+            if (!cnt || nodes[cnt - 1] != PARENT(node))
+                nodes[cnt++] = PARENT(node);
+        }
+
+        // nodes of the same level don't depend on each other
+        uint32_t log_size;
+        for (log_size = 2; cnt; log_size++) {
+            for (j = k = 0; j < cnt; j++) {
+                buddy_merge(pages_b, nodes[j], log_size);
+                if (nodes[j] && (!k || nodes[k - 1] != PARENT(nodes[j])))
+                    nodes[k++] = PARENT(nodes[j]);
+            }
+            cnt = k;
+        }
 
-        uint32_t l = pages_b->tree[LEFT_CHILD(cur_node)] & 7;
-        uint32_t r = pages_b->tree[RIGHT_CHILD(cur_node)] & 7;
+        pas += m;
+        n -= m;
+    }
+}
+
+// Whether kfree() would cache the single page at pa in the magazine rather
+// than give it back to the buddy system. Pages of a zone with a reserve go
+// straight back to it, and so do high pages, which the magazines don't hold.
+static bool page_mag_takes(physaddr_t pa)
+{
+    uint32_t z = zone_of(PGNUM(pa));
+    return use_page_mags && buddy_is_single(pa) && !zones[z].reserve && z != ZONE_HIGH;
+}
+
+// Free n single pages, from kmalloc(1) or kmalloc_bulk(). Like kfree(), the
+// magazine takes the pages it would cache, but only until it's full: the
+// others are freed to the buddy system together by buddy_free_bulk().
+void kfree_bulk(physaddr_t *pas, size_t n)
+{
+    struct PageMag *mag = this_page_mag();
+    physaddr_t batch[KFREE_BULK_BATCH];
+    uint32_t i, cnt = 0;
+
+    buddy_required("kfree_bulk");
+
+    for (i = 0; i < n; i++) {
+        page_unaccount(pas[i], 1);
+        if (page_mag_takes(pas[i]) && mag->count < mag_high) {
+            page_mag_push(mag, pas[i]);
+            continue;
+        }
+        batch[cnt++] = pas[i];
+        if (cnt == KFREE_BULK_BATCH) {
+            buddy_free_bulk(batch, cnt);
+            cnt = 0;
+        }
+    }
+    buddy_free_bulk(batch, cnt);
+}
+
+// Zero a page for the pool if it's short of its target. Call it when there's
+// nothing else to do, it only does one page at a time to stay responsive.
+void page_zero_idle(void)
+{
+    if (pmem != &pmem_buddy || !use_zero_pool || zero_pool.count >= zero_pool_target)
+        return;
+
+    zero_pool.idles++;
+    physaddr_t pa = page_mag_alloc();
+    if (pa == OUT_OF_MEM)
+        return;
+
+    memset(KADDR(pa), 0, PGSIZE);
+    zero_pool.pages[zero_pool.count++] = pa;
+    zero_pool.refills++;
+}
+
+// Like kmalloc(), but the pages must all be below max_pa, and begin at a
+// multiple of align bytes, which is a power of 2. Pass ~0 and PGSIZE for
+// no constraint. Only the part of the tree below max_pa is searched.
+physaddr_t kmalloc_constrained(size_t size, physaddr_t max_pa, size_t align)
+{
+    buddy_required("kmalloc_constrained");
+    if (size == 0)
+        return OUT_OF_MEM;
+
+    uint32_t order = log2_of(up_to_power_of_2(size - 1));
+
+    assert(IS_POWER_OF_2(align));
+    if (align > PGSIZE)
+        order = MAX(order, log2_of(align / PGSIZE));
+
+    physaddr_t pa = buddy_alloc_below(size, order, MIN(PGNUM(max_pa), npages_low));
+    if (pa != OUT_OF_MEM)
+        page_account(pa, size, OWNER_KERNEL);
+    return pa;
+}
+
+// kfree() without charging the pages back, returns how many there were.
+static uint32_t kfree_block(physaddr_t pa)
+{
+    uint64_t start = read_tsc();
+    uint32_t pages = 1;
+
+    if (!page_mag_takes(pa))
+        pages = buddy_free(pa);
+    else {
+        struct PageMag *mag = this_page_mag();
+        if (mag->count >= mag_high)
+            page_mag_drain(mag, mag_low);
+        page_mag_push(mag, pa);
+    }
+
+    lat_record(&lat_kfree, start);
+    return pages;
+}
+
+void kfree(physaddr_t pa)
+{
+    buddy_required("kfree");
+    page_unaccount(pa, kfree_block(pa));
+}
+
+static uint32_t bench_rand(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+// Cycles per single page allocation and free in a scratch tree of size
+// pages in the given layout. Everything is allocated first, then half of
+// it is freed in random order and allocated again, so that the walks are
+// spread all over the tree. Returns -E_NO_MEM if there's no room for it.
+static int buddy_bench_one(uint32_t size, bool blocked, uint32_t *pns,
+        uint32_t *alloc_cycles, uint32_t *free_cycles)
+{
+    uint32_t bytes = buddy_layout(NULL, size, blocked);
+    physaddr_t pa = kmalloc(ROUNDUP(bytes, PGSIZE) / PGSIZE);
+    if (pa == OUT_OF_MEM)
+        return -E_NO_MEM;
+
+    struct Buddy *b = KADDR(pa);
+    uint32_t i, j, n = size / 2, seed = 1;
+    uint64_t t;
+    bool cont;
+
+    memset(b, 0, bytes);
+    buddy_layout(b, size, blocked);
+    for (i = 0; i < size; i++)
+        BUDDY_TREE(b, size - 1 + i) = 1;
+    buddy_tree_build(b);
+
+    for (i = 0; i < size; i++)
+        pns[i] = buddy_tree_alloc(b, 1, 0, 0, size);
+    for (i = size - 1; i > 0; i--) {
+        uint32_t tmp = pns[i];
+        j = bench_rand(&seed) % (i + 1);
+        pns[i] = pns[j];
+        pns[j] = tmp;
+    }
+
+    t = read_tsc();
+    for (i = 0; i < n; i++)
+        buddy_tree_free(b, pns[i], &cont);
+    *free_cycles = (read_tsc() - t) / n;
+
+    t = read_tsc();
+    for (i = 0; i < n; i++)
+        pns[i] = buddy_tree_alloc(b, 1, 0, 0, size);
+    *alloc_cycles = (read_tsc() - t) / n;
+
+    for (i = 0; i < n; i++)
+        assert(pns[i] < size);
+    kfree(pa);
+    return 0;
+}
+
+// For the monitor commands about the buddy system
+static bool buddy_in_use(void)
+{
+    if (pmem == &pmem_buddy)
+        return true;
+    cprintf("The page allocator is %s, not the buddy system\n", pmem->name);
+    return false;
+}
+
+// Compare the tree layouts at 64MB, 256MB, and the size of the tree in use,
+// 1 << buddy_max_order pages, if that's bigger. The trees are scratch copies
+// in low memory, the sizes it has no room for are left out.
+int buddy_bench(void)
+{
+    uint32_t sizes[] = { 64 << 20 >> PGSHIFT, 256 << 20 >> PGSHIFT, 1 << buddy_max_order };
+    uint32_t n = sizeof(sizes) / sizeof(sizes[0]);
+    uint32_t i, alloc_cycles, free_cycles;
+    physaddr_t pa;
+    int blocked;
+
+    if (!buddy_in_use())
+        return 1;
+
+    if (sizes[n - 1] <= sizes[n - 2])
+        n--;
+    cprintf("memory  layout    alloc     free  (cycles per page)\n");
+    // the page numbers for the largest one
+    while ((pa = kmalloc(ROUNDUP(sizes[n - 1] * sizeof(uint32_t), PGSIZE) / PGSIZE)) == OUT_OF_MEM) {
+        cprintf("%4uMB  out of memory\n", sizes[n - 1] >> (20 - PGSHIFT));
+        if (--n == 0)
+            return -E_NO_MEM;
+    }
+
+    for (i = 0; i < n; i++)
+        for (blocked = 0; blocked <= 1; blocked++) {
+            if (buddy_bench_one(sizes[i], blocked, KADDR(pa), &alloc_cycles, &free_cycles) < 0) {
+                cprintf("%4uMB  out of memory\n", sizes[i] >> (20 - PGSHIFT));
+                continue;
+            }
+            cprintf("%4uMB  %-7s %7u  %7u\n", sizes[i] >> (20 - PGSHIFT),
+                    blocked ? "blocked" : "flat", alloc_cycles, free_cycles);
+        }
+
+    kfree(pa);
+    return 0;
+}
+
+#define PMEM_BENCH_PAGES    1024
+#define PMEM_BENCH_ROUNDS   16
+
+// Allocate and free batches of single pages through pmem, freeing them in
+// random order, to compare the backends across boots.
+int pmem_bench(void)
+{
+    static physaddr_t pas[PMEM_BENCH_PAGES];
+    uint32_t seed = 1, round, i, j, n = 0;
+    uint64_t t, alloc_cycles = 0, free_cycles = 0, total = 0;
+
+    for (round = 0; round < PMEM_BENCH_ROUNDS; round++) {
+        t = read_tsc();
+        for (n = 0; n < PMEM_BENCH_PAGES; n++)
+            if ((pas[n] = pmem->alloc(0)) == OUT_OF_MEM)
+                break;
+        alloc_cycles += read_tsc() - t;
+
+        for (i = n - 1; n && i > 0; i--) {
+            physaddr_t tmp = pas[i];
+            j = bench_rand(&seed) % (i + 1);
+            pas[i] = pas[j];
+            pas[j] = tmp;
+        }
+
+        t = read_tsc();
+        for (i = 0; i < n; i++)
+            pmem->free(pas[i]);
+        free_cycles += read_tsc() - t;
+        total += n;
+    }
+
+    cprintf("%s: %u bytes of metadata, %u.%02u bits per page\n", pmem->name,
+            pmem_meta_bytes, pmem_meta_bytes * 8 / npages,
+            pmem_meta_bytes * 800 / npages % 100);
+    if (!total) {
+        cprintf("out of memory\n");
+        return 1;
+    }
+    cprintf("%u pages: alloc %u cycles/page, free %u cycles/page\n", (uint32_t) total,
+            (uint32_t)(alloc_cycles / total), (uint32_t)(free_cycles / total));
+    return 0;
+}
+
+int zone_info(void)
+{
+    int z;
+    cprintf("zone      start       end     free  reserve     allocs   fails\n");
+    for (z = 0; z < NZONES; z++)
+        cprintf("%-6s %08llx  %08llx %8u %8u %10u %7u\n", zones[z].name,
+                (uint64_t) zones[z].lo << PGSHIFT, (uint64_t) zones[z].hi << PGSHIFT,
+                zones[z].nfree,
+                zones[z].reserve, zones[z].allocs, zones[z].fails);
+    return 0;
+}
+
+// Count the free blocks of each order under node, whose full size is
+// 2^(log_size-1) pages, i.e. the highest nodes that are entirely free.
+static void buddy_tree_count(struct Buddy *b, uint32_t node, uint32_t log_size,
+        uint32_t *nblocks)
+{
+    bnode_t v = BUDDY_TREE(b, node) & 0x1f;
+
+    if (v == 0) return;
+    if (v == log_size) {
+        nblocks[log_size - 1]++;
+        return;
+    }
+    buddy_tree_count(b, LEFT_CHILD(node), log_size - 1, nblocks);
+    buddy_tree_count(b, RIGHT_CHILD(node), log_size - 1, nblocks);
+}
+
+static void lat_print(struct LatHist *h)
+{
+    cprintf("%-10s %8u calls", h->name, h->count);
+    if (h->count)
+        cprintf(", %u cycles avg", (uint32_t)(h->cycles / h->count));
+    cprintf("\n");
+}
+
+int buddy_info(void)
+{
+    uint32_t nblocks[BUDDY_MAX_ORDER + 1], nlazy[BUDDY_MAX_ORDER + 1];
+    uint32_t order, i, z, total = 0, below = 0, largest = 0;
+    int top = -1;
+
+    if (!buddy_in_use())
+        return 1;
+
+    memset(nblocks, 0, sizeof(nblocks));
+    memset(nlazy, 0, sizeof(nlazy));
+    if (use_buddy_lists) {
+        for (z = 0; z < NZONES; z++)
+            for (order = 0; order <= BUDDY_MAX_ORDER; order++) {
+                struct BuddyLink *b;
+                for (b = buddy_free_lists[z][order]; b; b = b->next)
+                    nblocks[order]++;
+                nlazy[order] += buddy_lazy[z][order];
+            }
+    } else
+        buddy_tree_count(pages_b, 0, log2_of(pages_b->size) + 1, nblocks);
+
+    for (order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        total += nblocks[order] << order;
+        if (nblocks[order]) top = order;
+    }
+    if (top >= 0) largest = 1 << top;
+
+    // unusable: the share of free memory in blocks too small for a request
+    // of that order, Gorman's unusable free space index
+    // lazy: blocks left unmerged with their free buddies
+    cprintf("order   blocks     pages  unusable    lazy\n");
+    for (order = 0; (int) order <= top; order++) {
+        cprintf("%5u %8u %9u  %7u%% %7u\n", order, nblocks[order],
+                nblocks[order] << order, total ? below * 100 / total : 0,
+                nlazy[order]);
+        below += nblocks[order] << order;
+    }
+    // fragmentation: the share of free memory outside the largest block
+    cprintf("%u pages free, largest block %u pages, fragmentation %u%%\n",
+            total, largest, total ? 100 - largest * 100 / total : 0);
+    if (use_buddy_lists && use_buddy_lazy)
+        cprintf("lazy merging: %u hits, %u forced merges\n",
+                buddy_lazy_hits, buddy_lazy_forced);
+
+    // cycles per call, one row per power of 2 that any call fell into
+    cprintf("\n  cycles");
+    for (i = 0; i < NLAT_HISTS; i++)
+        cprintf(" %10s", lat_hists[i]->name);
+    cprintf("\n");
+    for (order = 0; order < LAT_BUCKETS; order++) {
+        for (i = 0; i < NLAT_HISTS && !lat_hists[i]->buckets[order]; i++)
+            /* do nothing */;
+        if (i == NLAT_HISTS) continue;
+        cprintf("  >=2^%2u", order);
+        for (i = 0; i < NLAT_HISTS; i++)
+            cprintf(" %10u", lat_hists[i]->buckets[order]);
+        cprintf("\n");
+    }
+    for (i = 0; i < NLAT_HISTS; i++)
+        lat_print(lat_hists[i]);
+    return 0;
+}
+
+// Start the latency histograms over, e.g. before a workload to measure
+void buddy_info_reset(void)
+{
+    uint32_t i;
+    for (i = 0; i < NLAT_HISTS; i++) {
+        lat_hists[i]->count = 0;
+        lat_hists[i]->cycles = 0;
+        memset(lat_hists[i]->buckets, 0, sizeof(lat_hists[i]->buckets));
+    }
+}
+
+int page_mag_info(void)
+{
+    int i;
+    cprintf("high %u  low %u  batch %u\n", mag_high, mag_low, mag_batch);
+    for (i = 0; i < NCPU; i++)
+        cprintf("cpu %d: %u pages  %u hits  %u refills  %u drains\n", i,
+                page_mags[i].count, page_mags[i].hits,
+                page_mags[i].refills, page_mags[i].drains);
+    return 0;
+}
+
+int zero_pool_info(void)
+{
+    uint32_t total = zero_pool.hits + zero_pool.misses;
+    cprintf("%u/%u pages  %u hits  %u misses  %u%% hit\n",
+            zero_pool.count, zero_pool_target, zero_pool.hits, zero_pool.misses,
+            total ? zero_pool.hits * 100 / total : 0);
+    cprintf("%u pages zeroed in %u idle calls\n", zero_pool.refills, zero_pool.idles);
+    if (zero_page != OUT_OF_MEM)
+        cprintf("Zero page: %u mappings, %u copied on write\n",
+                BUDDY_GET_REF(pages_b, zero_page) - 1, zero_page_copies);
+    return 0;
+}
 
-        if (l == log_size - 1 && r == log_size - 1)
-            // Both children are free, merge them
-            pages_b->tree[cur_node] = log_size;
-        else
-            buddy_update(pages_b, cur_node);
+// Pages allocated by each owner, and where the others are
+int page_owner_info(void)
+{
+    static const char *names[OWNER_ENV_BASE] = {
+        [OWNER_KERNEL] = "kernel heap",
+        [OWNER_PGTABLE] = "page tables",
+        [OWNER_USER] = "user",
+        [OWNER_BOOT] = "boot",
+    };
+    uint32_t i, cached = zero_pool.count;
+    char name[16];
+
+    if (pmem != &pmem_buddy) {
+        cprintf("Only the buddy allocator keeps page owners\n");
+        return 0;
+    }
+
+    cprintf("owner            pages         KB\n");
+    for (i = 0; i < NOWNERS; i++) {
+        if (i >= OWNER_ENV_BASE && !owner_pages[i])
+            continue;
+        if (i >= OWNER_ENV_BASE)
+            snprintf(name, sizeof(name), "env %u", i - OWNER_ENV_BASE);
+        cprintf("%-12s %9u %10u\n", i < OWNER_ENV_BASE ? names[i] : name,
+                owner_pages[i], owner_pages[i] * (PGSIZE / 1024));
     }
+
+    for (i = 0; i < NCPU; i++)
+        cached += page_mags[i].count;
+    cprintf("%-12s %9u %10u\n", "cached", cached, cached * (PGSIZE / 1024));
+    cprintf("%-12s %9u %10u\n", "free", buddy_nfree(), buddy_nfree() * (PGSIZE / 1024));
+    cprintf("%u pages mapped by page tables, %uK not set up yet\n", pages_mapped,
+            (page_init_end - page_init_next) * (PGSIZE / 1024));
+    return 0;
+}
+
+int zero_pool_tune(uint32_t target)
+{
+    if (target > ZERO_POOL_SIZE)
+        return -E_INVAL;
+
+    zero_pool_target = target;
+    while (zero_pool.count > target)
+        kfree_block(zero_pool.pages[--zero_pool.count]);
+    return 0;
+}
+
+int page_mag_tune(uint32_t high, uint32_t low, uint32_t batch)
+{
+    if (high > PAGE_MAG_SIZE || low >= high || batch == 0 || batch > high)
+        return -E_INVAL;
+
+    mag_high = high;
+    mag_low = low;
+    mag_batch = batch;
+
+    int i;
+    for (i = 0; i < NCPU; i++)
+        if (page_mags[i].count > high)
+            page_mag_drain(&page_mags[i], high);
+    return 0;
 }
 
 //
@@ -478,13 +2492,74 @@ page_decref(struct PageInfo* pp)
 		page_free(pp);
 }
 
-void page_decref_b(physaddr_t pa)
+// The buddy system as a pmem backend
+static void *buddy_pmem_init(size_t *meta_bytes)
+{
+    page_init_b();
+    // the descriptors, tree and tags follow each other
+    *meta_bytes = (char *) boot_alloc(0) - (char *) page_descs;
+    owner_pages[OWNER_BOOT] = PGNUM(PADDR(boot_alloc(0))) - PGNUM(EXTPHYSMEM);
+    return page_descs;
+}
+
+// Once the kernel's page directory is installed. The checks write to the
+// pages they allocate, which may lie anywhere in low memory, so they don't
+// depend on how much of it entry_pgdir maps.
+static void buddy_pmem_check(void)
+{
+    if (use_buddy_lists) check_buddy_free_lists();
+    check_page_alloc_b();
+    check_kmalloc_trim();
+    check_kmalloc_constrained();
+    check_zero_pool();
+    check_kmalloc_bulk();
+    check_page_owners();
+    if (use_buddy_lists) check_buddy_lazy();
+#ifdef BUDDY_COMPACT
+    if (use_buddy_lists) check_buddy_compact();
+#endif
+    check_page_b();
+    check_page_large();
+    check_page_promote();
+    check_highmem();
+    check_zero_page();
+}
+
+static void buddy_incref(physaddr_t pa)
+{
+    assert(BUDDY_GET_REF(pages_b, pa) < PD_REF_MAX);
+    BUDDY_INC_REF(pages_b, pa);
+}
+
+static void buddy_decref(physaddr_t pa)
 {
+    // with the packed layout, the borrow would go into the node's order
+    assert(BUDDY_GET_REF(pages_b, pa) > 0);
     BUDDY_DEC_REF(pages_b, pa);
-    if (BUDDY_GET_REF(pages_b, pa) == 0)
+    if (BUDDY_GET_REF(pages_b, pa) == 0) {
+        // mappings hold references
+        assert(page_descs[PGNUM(pa)].pd_mapcount == 0);
         kfree(pa);
+    }
+}
+
+static uint32_t buddy_lookup(physaddr_t pa)
+{
+    return BUDDY_GET_REF(pages_b, pa);
 }
 
+const struct PmemOps pmem_buddy = {
+    .name = "buddy",
+    .init = buddy_pmem_init,
+    .alloc = kmalloc_page,
+    .free = kfree,
+    .incref = buddy_incref,
+    .decref = buddy_decref,
+    .lookup = buddy_lookup,
+    .alloc_bulk = kmalloc_bulk,
+    .check = buddy_pmem_check,
+};
+
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
 // a pointer to the page table entry (PTE) for linear address 'va'.
 // This requires walking the two-level page table structure.
@@ -521,25 +2596,30 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 
     if (!create) return NULL;
 
-    if (use_buddy) {
-        physaddr_t pa = kmalloc(1);
-        if (pa == OUT_OF_MEM) return NULL;
-        memset(KADDR(pa), 0, PGSIZE);
+    uint64_t start = read_tsc();
+    physaddr_t pa = pmem->alloc(ALLOC_ZERO | ALLOC_OWNER(OWNER_PGTABLE));
+    lat_record(&lat_pgdir_walk, start);
+    if (pa == OUT_OF_MEM) return NULL;
 
-        BUDDY_INC_REF(pages_b, pa);
-        *pde = pa | PTE_P | PTE_W | PTE_U;
-        return (pte_t*)KADDR(pa) + PTX(va);
-    }
-
-    struct PageInfo *p = page_alloc(ALLOC_ZERO);
-    if (!p) return NULL;
+    assert(pmem->lookup(pa) == 0);
+    pmem->incref(pa);
+    *pde = pa | PTE_P | PTE_W | PTE_U;
+    return (pte_t*)KADDR(pa) + PTX(va);
+}
 
-    assert(p->pp_ref == 0);
-    p->pp_ref = 1;
-    *pde = page2pa(p) | PTE_P | PTE_W | PTE_U;
-    return (pte_t*)page2kva(p) + PTX(va);
+// Is pte, as returned by pgdir_walk(), the directory entry of a large page?
+static inline bool pte_is_large(pde_t *pgdir, const void *va, pte_t *pte)
+{
+    return pte == (pte_t *) &pgdir[PDX(va)];
 }
 
+// Set in an available bit of a large page put together by page_promote(),
+// whose small pages keep their own references. Users can't set the bits
+// of directory entries.
+#define PDE_PROMOTED    0x200
+// What a large page keeps of the entries of its small pages
+#define PTE_PROMOTE_MASK    (0xfff & ~(PTE_A | PTE_D))
+
 //
 // Map [va, va+size) of virtual address space to physical [pa, pa+size)
 // in the page table rooted at pgdir.  Size is a multiple of PGSIZE, and
@@ -558,12 +2638,41 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
     if (perm & PTE_PS)
         for (i = 0; i < size; i += PGSIZE_PSE)
             pgdir[PDX(va + i)] = (pa + i) | perm | PTE_P;
-    else
+    else {
+        if (pmem->alloc_bulk)
+            pgdir_prealloc(pgdir, va, size);
         for (i = 0; i < size; i += PGSIZE) {
             pte_t *pte = pgdir_walk(pgdir, (void*)(va + i), 1);
             assert(pte);
             *pte = (pa + i) | perm | PTE_P;
         }
+    }
+}
+
+#define PREALLOC_BATCH  64
+
+// Install the page tables missing for [va, va+size) in pgdir, allocating
+// them with the bulk allocator of pmem. If out of memory, the rest is left to
+// pgdir_walk().
+static void pgdir_prealloc(pde_t *pgdir, uintptr_t va, size_t size)
+{
+    physaddr_t pas[PREALLOC_BATCH];
+    uint32_t pdx = PDX(va), last = PDX(va + size - 1);
+
+    while (pdx <= last) {
+        uint32_t end, n = 0, got, i = 0;
+        for (end = pdx; end <= last && n < PREALLOC_BATCH; end++)
+            if (!(pgdir[end] & PTE_P)) n++;
+
+        got = pmem->alloc_bulk(pas, n, ALLOC_ZERO | ALLOC_OWNER(OWNER_PGTABLE));
+        for (; pdx < end; pdx++) {
+            if (pgdir[pdx] & PTE_P) continue;
+            if (i == got) return;
+
+            pmem->incref(pas[i]);
+            pgdir[pdx] = pas[i++] | PTE_P | PTE_W | PTE_U;
+        }
+    }
 }
 
 //
@@ -594,28 +2703,324 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 int
 page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
+    return page_insert_pa(pgdir, page2pa(pp), va, perm);
+}
+
+// Is pa one of the pages after the first of a block of PGSIZE_PSE bytes?
+// They have no reference counts of their own, the first page holds the
+// references to the whole block.
+static bool page_in_large_block(physaddr_t pa)
+{
+    return use_pse && pmem == &pmem_buddy && PGOFF_PSE(pa) &&
+        buddy_is_block(pa - PGOFF_PSE(pa), PGSHIFT_PSE - PGSHIFT);
+}
+
+// Same as page_insert(), for a page of any pmem backend. Fails with -E_INVAL
+// for a page inside a block that page_insert_large() could map, unless that
+// block is mapped at va, where demoting it splits it into single pages, and
+// with -E_NO_MEM if the counts of the page are at their limits.
+int page_insert_pa(pde_t *pgdir, physaddr_t pa, void *va, int perm)
+{
+    // the zero page is mapped too many times to count
+    struct PageDesc *d = pa == zero_page ? NULL : page_desc(pa);
+    if (d && page_in_large_block(pa)) {
+        pte_t *pde = pgdir_walk(pgdir, va, 0);
+        if (!pde || !pte_is_large(pgdir, va, pde) || PTE_ADDR(*pde) != pa - PGOFF_PSE(pa))
+            return -E_INVAL;
+    }
+
+    // everybody shares it, writes must fault and copy it
+    if (pa == zero_page && (perm & PTE_W))
+        perm = (perm & ~PTE_W) | PTE_COW;
+    // the counts of the page can't go any higher
+    if ((d && d->pd_mapcount == PD_MAPCOUNT_MAX) || pmem->lookup(pa) == PD_REF_MAX)
+        return -E_NO_MEM;
+
     pte_t *pte = pgdir_walk(pgdir, va, 1);
     if (!pte) return -E_NO_MEM;
+    // a page of its own in the middle of a large page
+    if (pte_is_large(pgdir, va, pte)) {
+        int r = page_demote(pgdir, va);
+        if (r < 0) return r;
+        pte = pgdir_walk(pgdir, va, 0);
+    }
 
-    pp->pp_ref++;
+    pmem->incref(pa);
     if (*pte & PTE_P)
         page_remove(pgdir, va); // TLB invalidated here
-    *pte = page2pa(pp) | perm | PTE_P;
+    *pte = pa | perm | PTE_P;
+    if (d && d->pd_mapcount++ == 0)
+        pages_mapped++;
     return 0;
 }
 
-int page_insert_b(pde_t *pgdir, physaddr_t pa, void *va, int perm)
+// Map the block of PGSIZE_PSE bytes at pa, as allocated by
+// kmalloc(PGSIZE_PSE / PGSIZE), at va with a single page directory entry.
+// Both must be aligned to PGSIZE_PSE. Like page_insert_pa(), the mapping
+// holds a reference, counted on the first page of the block, and replaces
+// the large page already at va. An empty page table in the way is freed.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if there's no PSE, they are not aligned, pa isn't such a
+//     block, or pages are still mapped by the page table at va
+//   -E_NO_MEM, if the counts of the block are at their limits
+int page_insert_large(pde_t *pgdir, physaddr_t pa, void *va, int perm)
+{
+    pde_t *pde = &pgdir[PDX(va)];
+    struct PageDesc *d = page_desc(pa);
+    uint32_t i;
+
+    if (!use_pse || !d || PGOFF_PSE(pa) || PGOFF_PSE(va))
+        return -E_INVAL;
+    // the pages after it belong to somebody else otherwise
+    if (!buddy_is_block(pa, PGSHIFT_PSE - PGSHIFT))
+        return -E_INVAL;
+    // a promoted one is still small pages to its users
+    if (*pde & PDE_PROMOTED)
+        return -E_INVAL;
+    if (d->pd_mapcount == PD_MAPCOUNT_MAX || pmem->lookup(pa) == PD_REF_MAX)
+        return -E_NO_MEM;
+
+    if ((*pde & PTE_P) && !(*pde & PTE_PS)) {
+        physaddr_t pt = PTE_ADDR(*pde);
+        pte_t *ptes = KADDR(pt);
+        for (i = 0; i < NPTENTRIES; i++)
+            if (ptes[i] & PTE_P) return -E_INVAL;
+        *pde = 0;
+        tlb_invalidate(pgdir, va);
+        pmem->decref(pt);
+    }
+
+    pmem->incref(pa);
+    if (*pde & PTE_P)
+        page_remove(pgdir, va); // TLB invalidated here
+    *pde = pa | perm | PTE_PS | PTE_P;
+    if (d->pd_mapcount++ == 0)
+        pages_mapped++;
+    return 0;
+}
+
+// Map zero-filled memory at va, the zero page when there's one. It's
+// mapped read-only, with PTE_COW instead of PTE_W if perm has it, so that
+// page_cow_fault() gives va a page of its own on the first write.
+// RETURNS: like page_insert_pa()
+int page_insert_zero(pde_t *pgdir, void *va, int perm)
+{
+#ifdef BUDDY_SPLIT_REF
+    // held by the kernel, so that it's never freed
+    if (zero_page == OUT_OF_MEM && pmem == &pmem_buddy &&
+            (zero_page = kmalloc_page(ALLOC_ZERO | ALLOC_HIGH)) != OUT_OF_MEM)
+        BUDDY_INC_REF(pages_b, zero_page);
+#endif
+
+    if (zero_page == OUT_OF_MEM) {
+        physaddr_t pa = pmem->alloc(ALLOC_ZERO | ALLOC_OWNER(OWNER_USER));
+        if (pa == OUT_OF_MEM)
+            return -E_NO_MEM;
+        int r = page_insert_pa(pgdir, pa, va, perm);
+        if (r < 0)
+            pmem->free(pa);
+        return r;
+    }
+
+    // page_insert_pa() turns PTE_W into PTE_COW
+    return page_insert_pa(pgdir, zero_page, va, perm);
+}
+
+// Replace the zero page mapped at va with PTE_COW by a private page of
+// '\0' bytes, from the zero pool if it has any, writable. The page fault
+// handler calls this on a write to a page that's present.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if va isn't the zero page mapped with PTE_COW, i.e. a real fault
+//   -E_NO_MEM, if out of memory
+int page_cow_fault(pde_t *pgdir, void *va)
+{
+    pte_t *pte;
+    physaddr_t pa = page_lookup_pa(pgdir, va, &pte);
+
+    if (pa == ADDR_UNAVAIL || pa != zero_page || !(*pte & PTE_COW))
+        return -E_INVAL;
+
+    physaddr_t copy = pmem->alloc(ALLOC_ZERO | ALLOC_OWNER(OWNER_USER));
+    if (copy == OUT_OF_MEM)
+        return -E_NO_MEM;
+    int r = page_insert_pa(pgdir, copy, va, (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W);
+    if (r < 0) {
+        pmem->free(copy);
+        return r;
+    }
+    zero_page_copies++;
+    return 0;
+}
+
+// Top up pt_reserve from the allocator, as far as there's memory for it
+static void pt_reserve_fill(void)
+{
+    physaddr_t pt;
+
+    while (pt_reserved < PT_RESERVE &&
+            (pt = pmem->alloc(ALLOC_OWNER(OWNER_PGTABLE))) != OUT_OF_MEM) {
+        pmem->incref(pt);
+        pt_reserve[pt_reserved++] = pt;
+    }
+}
+
+// Collapse the page table of va into a large page if it maps PGSIZE_PSE
+// bytes of contiguous memory, beginning at a multiple of PGSIZE_PSE, with
+// the same permissions everywhere. The small pages keep their references,
+// see PDE_PROMOTED, and the page table goes back to the allocator.
+// page_demote() allocates a new one. Below UTOP, any page directory will
+// do, above it only kern_pgdir, whose entries the others share.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if there's no PSE, va is above UTOP of a user page
+//     directory, or the page table doesn't qualify
+int page_promote(pde_t *pgdir, void *va)
+{
+    pde_t *pde = &pgdir[PDX(va)];
+    uint32_t i;
+
+    if (!use_pse || (pgdir != kern_pgdir && (uintptr_t) va >= UTOP) ||
+            !(*pde & PTE_P) || (*pde & PTE_PS))
+        return -E_INVAL;
+
+    physaddr_t pt = PTE_ADDR(*pde);
+    pte_t *ptes = KADDR(pt);
+    physaddr_t base = PTE_ADDR(ptes[0]);
+    uint32_t flags = ptes[0] & PTE_PROMOTE_MASK, ad = 0;
+
+    // PTE_PS of a small page is its PAT bit
+    if (!(flags & PTE_P) || (flags & (PTE_PS | PDE_PROMOTED)) || PGOFF_PSE(base)
+            || !page_desc(base) || !page_desc(base + PGSIZE_PSE - PGSIZE))
+        return -E_INVAL;
+    for (i = 0; i < NPTENTRIES; i++) {
+        if ((ptes[i] & ~(pte_t) (PTE_A | PTE_D)) != ((base + i * PGSIZE) | flags))
+            return -E_INVAL;
+        ad |= ptes[i] & (PTE_A | PTE_D);
+    }
+
+    // so that page_remove() can demote it again
+    pt_reserve_fill();
+    *pde = base | flags | ad | PTE_PS | PDE_PROMOTED;
+    va = ROUNDDOWN(va, PGSIZE_PSE);
+    for (i = 0; i < NPTENTRIES; i++)
+        tlb_invalidate(pgdir, va + i * PGSIZE);
+    pmem->decref(pt);
+    page_promotions++;
+    return 0;
+}
+
+// page_demote(), taking the page table from pt_reserve if reserve is set
+// and the allocator has none
+static int page_demote_from(pde_t *pgdir, void *va, bool reserve)
+{
+    pde_t *pde = &pgdir[PDX(va)];
+    uint32_t i;
+
+    if ((*pde & (PTE_P | PTE_PS)) != (PTE_P | PTE_PS))
+        return -E_INVAL;
+
+    physaddr_t base = PTE_ADDR(*pde);
+    struct PageDesc *d = page_desc(base);
+    bool promoted = *pde & PDE_PROMOTED;
+    uint32_t flags = *pde & PTE_PROMOTE_MASK & ~(PTE_PS | PDE_PROMOTED);
+
+    if (!promoted && (!d || pmem->lookup(base) != 1 || d->pd_mapcount != 1))
+        return -E_INVAL;
+
+    physaddr_t pt = pmem->alloc(ALLOC_OWNER(OWNER_PGTABLE));
+    if (pt != OUT_OF_MEM)
+        pmem->incref(pt);
+    else if (reserve && pt_reserved)
+        pt = pt_reserve[--pt_reserved];
+    else
+        return -E_NO_MEM;
+
+    pte_t *ptes = KADDR(pt);
+    for (i = 0; i < NPTENTRIES; i++)
+        ptes[i] = (base + i * PGSIZE) | flags | (*pde & (PTE_A | PTE_D));
+
+    if (!promoted) {
+        uint8_t owner = d->pd_owner;
+        buddy_split_pages(PGNUM(base), PGSHIFT_PSE - PGSHIFT);
+        page_unaccount(base, NPTENTRIES);
+        for (i = 0; i < NPTENTRIES; i++) {
+            page_account(base + i * PGSIZE, 1, owner);
+            if (i) {
+                pmem->incref(base + i * PGSIZE);
+                d[i].pd_mapcount = 1;
+            }
+        }
+        pages_mapped += NPTENTRIES - 1;
+    }
+
+    *pde = pt | PTE_P | PTE_W | PTE_U;
+    tlb_invalidate(pgdir, va);
+    page_demotions++;
+    return 0;
+}
+
+// Split the large page at va back into a page table of small pages, with
+// the same permissions, in a page table allocated for it. A promoted one
+// maps its small pages again. A block from page_insert_large() becomes as
+// many single pages, each of them mapped once, as if it had been mapped a
+// page at a time, which needs the large page to be its only user.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if there's no page for the page table
+//   -E_INVAL, if there's no large page at va, or others use its block
+int page_demote(pde_t *pgdir, void *va)
+{
+    return page_demote_from(pgdir, va, false);
+}
+
+// Try to promote the next page table below UTOP of kern_pgdir. Call it
+// when there's nothing else to do, it only looks at one at a time.
+void page_promote_idle(void)
+{
+    static uint32_t next;
+
+    if (!use_page_promote || pmem != &pmem_buddy)
+        return;
+    page_promote(kern_pgdir, (void *) (next * PTSIZE));
+    next = (next + 1) % PDX(UTOP);
+}
+
+// Promote every page table below UTOP of kern_pgdir that qualifies
+int page_promote_all(void)
 {
-    pte_t *pte = pgdir_walk(pgdir, va, 1);
-    if (!pte) return -E_NO_MEM;
+    uint32_t pdx, n = 0, large = 0;
 
-    BUDDY_INC_REF(pages_b, pa);
-    if (*pte & PTE_P)
-        page_remove_b(pgdir, va);
-    *pte = pa | perm | PTE_P;
+    if (pmem != &pmem_buddy) {
+        cprintf("Only the buddy allocator keeps page descriptors\n");
+        return 0;
+    }
+
+    for (pdx = 0; pdx < PDX(UTOP); pdx++) {
+        if (page_promote(kern_pgdir, (void *) (pdx * PTSIZE)) == 0)
+            n++;
+        if ((kern_pgdir[pdx] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+            large++;
+    }
+    cprintf("%u page tables promoted, %u large pages below UTOP\n", n, large);
+    cprintf("%u promotions and %u demotions since boot\n", page_promotions, page_demotions);
     return 0;
 }
 
+// The descriptor of the page at pa, NULL unless the buddy allocator
+// manages it.
+struct PageDesc *page_desc(physaddr_t pa)
+{
+    if (pmem != &pmem_buddy || PGNUM(pa) >= npages)
+        return NULL;
+    return &page_descs[PGNUM(pa)];
+}
+
 //
 // Return the page mapped at virtual address 'va'.
 // If pte_store is not zero, then we store in it the address
@@ -630,17 +3035,21 @@ int page_insert_b(pde_t *pgdir, physaddr_t pa, void *va, int perm)
 struct PageInfo *
 page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 {
-    pte_t *pte = pgdir_walk(pgdir, va, 0);
-    if (pte_store) *pte_store = pte;
-    assert(!pte || *pte & PTE_P);
-    return pte ? pa2page(PTE_ADDR(*pte)) : NULL;
+    physaddr_t pa = page_lookup_pa(pgdir, va, pte_store);
+    return pa == ADDR_UNAVAIL ? NULL : pa2page(pa);
 }
 
-physaddr_t page_lookup_b(pte_t *pgdir, void *va, pte_t **pte_store)
+// Same as page_lookup(), returns ADDR_UNAVAIL if there is no page at va
+physaddr_t page_lookup_pa(pde_t *pgdir, void *va, pte_t **pte_store)
 {
     pte_t *pte = pgdir_walk(pgdir, va, 0);
     if (pte_store) *pte_store = pte;
-    return pte ? PTE_ADDR(*pte) : ADDR_UNAVAIL;
+    if (!pte || !(*pte & PTE_P))
+        return ADDR_UNAVAIL;
+    // the page of va within a large page
+    if (pte_is_large(pgdir, va, pte))
+        return PTE_ADDR(*pte) + ROUNDDOWN(PGOFF_PSE(va), PGSIZE);
+    return PTE_ADDR(*pte);
 }
 
 //
@@ -662,25 +3071,27 @@ void
 page_remove(pde_t *pgdir, void *va)
 {
     pte_t *pte;
-    struct PageInfo *p = page_lookup(pgdir, va, &pte);
-
-    if (!p) return;
-    page_decref(p); // automatically freed
-
-    if (!pte) return;
-    *pte = 0;
-    tlb_invalidate(pgdir, va);
-}
-
-void page_remove_b(pde_t *pgdir, void *va)
-{
-    pte_t *pte;
-    physaddr_t pa = page_lookup_b(pgdir, va, &pte);
-
-    if (pa == OUT_OF_MEM) return;
-    page_decref_b(pa);
+    physaddr_t pa = page_lookup_pa(pgdir, va, &pte);
+
+    if (pa == ADDR_UNAVAIL) return;
+    if (pte_is_large(pgdir, va, pte) && (*pte & PDE_PROMOTED)) {
+        // only the page at va goes, back in a page table of its own
+        if (page_demote_from(pgdir, va, true) < 0)
+            panic("page_remove: no page table to demote %p", va);
+        pa = page_lookup_pa(pgdir, va, &pte);
+    } else if (pte_is_large(pgdir, va, pte)) {
+        // all of it goes, the reference is on its first page
+        pa = PTE_ADDR(*pte);
+        va = ROUNDDOWN(va, PGSIZE_PSE);
+    }
+    struct PageDesc *d = pa == zero_page ? NULL : page_desc(pa);
+    if (d) {
+        assert(d->pd_mapcount > 0);
+        if (--d->pd_mapcount == 0)
+            pages_mapped--;
+    }
+    pmem->decref(pa); // automatically freed
 
-    if (!pte) return;
     *pte = 0;
     tlb_invalidate(pgdir, va);
 }
@@ -697,6 +3108,122 @@ tlb_invalidate(pde_t *pgdir, void *va)
 	invlpg(va);
 }
 
+// --------------------------------------------------------------
+// Temporary mappings of high memory.
+// kmap() and kmap_atomic() return a kernel virtual address of any physical
+// address: the one at KERNBASE in low memory, otherwise a slot of the page
+// table at KMAPBASE, which is only valid until kunmap() or kunmap_atomic().
+// --------------------------------------------------------------
+
+static inline void *kmap_slot_va(uint32_t slot)
+{
+    return (void *) (KMAPBASE + slot * PGSIZE);
+}
+
+static inline void kmap_set(uint32_t slot, physaddr_t pa)
+{
+    assert(kmap_ptes);
+    kmap_ptes[slot] = pa | PTE_P | PTE_W;
+    invlpg(kmap_slot_va(slot));
+}
+
+// Map the page at pa in a shared slot, whether it's high or not.
+static void *kmap_high(physaddr_t pa)
+{
+    uint32_t hint = PGNUM(pa) % KMAP_HINTS, slot = kmap_hint[hint], i;
+
+    // still mapped from last time?
+    if (slot >= KMAP_FIRST && kmap_ptes[slot] == (pa | PTE_P | PTE_W)) {
+        kmap_count[slot]++;
+        return kmap_slot_va(slot);
+    }
+
+    for (i = KMAP_FIRST; i < KMAP_SLOTS; i++) {
+        slot = kmap_hand;
+        if (++kmap_hand == KMAP_SLOTS)
+            kmap_hand = KMAP_FIRST;
+        if (kmap_count[slot])
+            continue;
+
+        kmap_set(slot, pa);
+        kmap_count[slot] = 1;
+        kmap_hint[hint] = slot;
+        return kmap_slot_va(slot);
+    }
+    panic("kmap: all %u slots in use", KMAP_SLOTS - KMAP_FIRST);
+}
+
+// Map the page at pa in the next slot of this CPU's stack, whether it's
+// high or not.
+static void *kmap_atomic_high(physaddr_t pa)
+{
+    uint32_t cpu = 0; // no SMP yet
+
+    if (kmap_atomic_depth[cpu] == KMAP_ATOMIC)
+        panic("kmap_atomic: more than %u pages mapped", KMAP_ATOMIC);
+    uint32_t slot = cpu * KMAP_ATOMIC + kmap_atomic_depth[cpu]++;
+    kmap_set(slot, pa);
+    return kmap_slot_va(slot);
+}
+
+static inline void kmap_check_pa(physaddr_t pa)
+{
+    if (PGNUM(pa) >= npages)
+        panic("kmap called with invalid pa %08llx", (uint64_t) pa);
+}
+
+// Map pa until kunmap(), for as long as needed. Pages stay mapped at the
+// same address while they're in use, so it may be called again on a page
+// that's already mapped. Panics if all the slots are in use.
+void *kmap(physaddr_t pa)
+{
+    if (PGNUM(pa) < npages_low)
+        return KADDR(pa);
+    kmap_check_pa(pa);
+    return (char *) kmap_high(pa - PGOFF(pa)) + PGOFF(pa);
+}
+
+void kunmap(void *va)
+{
+    if ((uintptr_t) va < KMAPBASE) {
+        assert((uintptr_t) va >= KERNBASE);
+        return;
+    }
+
+    uint32_t slot = PGNUM((uintptr_t) va - KMAPBASE);
+    assert(slot >= KMAP_FIRST && kmap_count[slot] > 0);
+    kmap_count[slot]--;
+}
+
+// Map pa until kunmap_atomic(), which must be called soon, and in the
+// reverse order of kmap_atomic(): each CPU has KMAP_ATOMIC slots only.
+// Takes just a PTE and an invlpg, for short accesses like zeroing or
+// copying a page.
+void *kmap_atomic(physaddr_t pa)
+{
+    if (PGNUM(pa) < npages_low)
+        return KADDR(pa);
+    kmap_check_pa(pa);
+    return (char *) kmap_atomic_high(pa - PGOFF(pa)) + PGOFF(pa);
+}
+
+void kunmap_atomic(void *va)
+{
+    uint32_t cpu = 0; // no SMP yet
+
+    if ((uintptr_t) va < KMAPBASE) {
+        assert((uintptr_t) va >= KERNBASE);
+        return;
+    }
+
+    // The PTE is left as it is, kmap_set() flushes it before the slot is
+    // used again.
+    uint32_t slot = PGNUM((uintptr_t) va - KMAPBASE);
+    assert(kmap_atomic_depth[cpu] > 0);
+    assert(slot == cpu * KMAP_ATOMIC + kmap_atomic_depth[cpu] - 1);
+    kmap_atomic_depth[cpu]--;
+}
+
 #define PTE_FLAG_MASK   0x1ff
 #define PTE_FLAGS(pte)  ((uint32_t) (pte) & 0x1ff)
 #define INVALID_FLAGS   ~0
@@ -710,9 +3237,9 @@ static inline void print_pages(uint32_t low, uint32_t high, uint32_t flags)
     int pgcnt = flags & PTE_PS ? PGSHIFT_PSE : PGSHIFT;
     pgcnt = (high - low + 1) >> pgcnt;
 
-    cprintf("%08x-%08x  %08x-%08x  %c%c%c%c%c%c%c%cP  4%c * %d\n",
+    cprintf("%08x-%08x  %08llx-%08llx  %c%c%c%c%c%c%c%cP  %u%c * %d\n",
             low, high + 1,
-            va2pa(kern_pgdir, low), va2pa(kern_pgdir, high) + 1,
+            (uint64_t) va2pa(kern_pgdir, low), (uint64_t) va2pa(kern_pgdir, high) + 1,
             flags & PTE_G   ? 'G' : '-',
             flags & PTE_PS  ? 'S' : '-',
             flags & PTE_D   ? 'D' : '-',
@@ -721,6 +3248,7 @@ static inline void print_pages(uint32_t low, uint32_t high, uint32_t flags)
             flags & PTE_PWT ? 'T' : '-',
             flags & PTE_U   ? 'U' : '-',
             flags & PTE_W   ? 'W' : '-',
+            flags & PTE_PS  ? PGSIZE_PSE >> 20 : PGSIZE >> 10,
             flags & PTE_PS  ? 'M' : 'K',
             pgcnt);
 }
@@ -806,6 +3334,14 @@ int setpage(uint32_t low, uint32_t high, const char *perm)
     low = ROUNDDOWN(low, PGSIZE);
     while (true) {
         pte_t *pte = pgdir_walk(kern_pgdir, (const void *)low, 0);
+        // pages of a promoted large page get their own entries back
+        if (pte && (*pte & PDE_PROMOTED) && pte_is_large(kern_pgdir, (void *)low, pte)) {
+            if (page_demote(kern_pgdir, (void *)low) < 0) {
+                cprintf("Out of memory for the page table of 0x%08x\n", low);
+                return 1;
+            }
+            pte = pgdir_walk(kern_pgdir, (const void *)low, 0);
+        }
         *pte = (*pte & ~PTE_FLAG_MASK) | flags;
 
         if (high - low < PGSIZE) break;
@@ -823,7 +3359,12 @@ int memdump(uint32_t low, uint32_t size, bool phys)
             if (i) cprintf("\n");
             cprintf("%08x: ", low + i);
         }
-        cprintf("%08x ", *(phys ? (uint32_t*)KADDR(low + i) : (uint32_t*)(low + i)));
+        if (phys) {
+            uint32_t *p = kmap_atomic(low + i);
+            cprintf("%08x ", *p);
+            kunmap_atomic(p);
+        } else
+            cprintf("%08x ", *(uint32_t*)(low + i));
     }
     if ((i - 4) % 32) cprintf("\n");
     return 0;
@@ -902,6 +3443,7 @@ check_page_alloc(void)
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
 	int nfree;
 	struct PageInfo *fl;
+	uint32_t end;
 	char *c;
 	int i;
 
@@ -921,13 +3463,14 @@ check_page_alloc(void)
 	assert(pp0);
 	assert(pp1 && pp1 != pp0);
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
-	assert(page2pa(pp0) < npages*PGSIZE);
-	assert(page2pa(pp1) < npages*PGSIZE);
-	assert(page2pa(pp2) < npages*PGSIZE);
+	assert(PGNUM(page2pa(pp0)) < npages);
+	assert(PGNUM(page2pa(pp1)) < npages);
+	assert(PGNUM(page2pa(pp2)) < npages);
 
 	// temporarily steal the rest of the free pages
 	fl = page_free_list;
 	page_free_list = 0;
+	end = page_init_hold();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -956,6 +3499,7 @@ check_page_alloc(void)
 
 	// give free list back
 	page_free_list = fl;
+	page_init_release(end);
 
 	// free the pages we took
 	page_free(pp0);
@@ -970,6 +3514,104 @@ check_page_alloc(void)
 	cprintf(COLOR_BLUE"check_page_alloc() succeeded!\n"COLOR_NONE);
 }
 
+// Temporarily take away all free memory of the buddy system, including the
+// pages cached by the magazines and the zero pool.
+// In free-list mode the blocks are chained through their links with the
+// free tag cleared, so that kfree() won't merge with them before
+// buddy_give_back() frees them again. The pages not set up yet are held
+// back until then as well.
+static uint32_t buddy_steal_end;
+
+static uint32_t buddy_steal()
+{
+    buddy_steal_end = page_init_hold();
+    page_caches_drain();
+
+    if (!use_buddy_lists) {
+        uint32_t t0 = BUDDY_TREE(pages_b, 0);
+        BUDDY_TREE(pages_b, 0) = 0;
+        return t0;
+    }
+
+    struct BuddyLink *stolen = NULL;
+    uint32_t z, order;
+    for (z = 0; z < NZONES; z++)
+        for (order = 0; order <= buddy_max_order; order++)
+            while (buddy_free_lists[z][order]) {
+                struct BuddyLink *b = buddy_free_lists[z][order];
+                buddy_unlink(b, order);
+                buddy_set_tag(buddy_link_pn(b), order);
+                b->next = stolen;
+                stolen = b;
+            }
+    return (uint32_t)stolen;
+}
+
+static void buddy_give_back(uint32_t t0)
+{
+    page_init_release(buddy_steal_end);
+    if (!use_buddy_lists) {
+        BUDDY_TREE(pages_b, 0) = t0;
+        return;
+    }
+
+    struct BuddyLink *b = (struct BuddyLink *)t0;
+    while (b) {
+        struct BuddyLink *next = b->next;
+        kfree_block((physaddr_t) buddy_link_pn(b) << PGSHIFT);
+        b = next;
+    }
+}
+
+//
+// Check that the blocks on the buddy free lists are reasonable.
+//
+static void check_buddy_free_lists()
+{
+    uint32_t z, order, nfree = 0;
+    char *first_free_page = (char *) boot_alloc(0);
+
+    for (z = 0; z < NZONES; z++) {
+        uint32_t zone_nfree = 0;
+        for (order = 0; order <= buddy_max_order; order++) {
+            struct BuddyLink *b, *prev = NULL;
+            uint32_t nlazy = 0;
+            for (b = buddy_free_lists[z][order]; b; prev = b, b = b->next) {
+                uint32_t pn = buddy_link_pn(b);
+                physaddr_t pa = (physaddr_t) pn << PGSHIFT;
+                bool lazy = buddy_tag(pn) & BUDDY_TAG_LAZY;
+
+                // check that we didn't corrupt the lists themselves
+                assert(b->prev == prev);
+                assert(b == buddy_link(pn));
+                assert(pn % (1 << order) == 0);
+                assert(pn >= zones[z].lo && pn + (1 << order) <= zones[z].hi);
+                assert((buddy_tag(pn) & ~BUDDY_TAG_LAZY) == (BUDDY_TAG_FREE | order));
+
+                // the buddy can't be free with the same order in the same
+                // zone, or they should have been merged, unless one of them
+                // was left unmerged on purpose
+                assert(!buddy_buddy_free(pn, order) || lazy ||
+                        (buddy_tag(pn ^ (1 << order)) & BUDDY_TAG_LAZY));
+                nlazy += lazy;
+
+                // check a few pages that shouldn't be on the free lists
+                assert(pa != 0);
+                assert(pa + (PGSIZE << order) <= IOPHYSMEM ||
+                        pa >= PADDR(first_free_page));
+
+                zone_nfree += 1 << order;
+            }
+            assert(nlazy == buddy_lazy[z][order]);
+        }
+        assert(zone_nfree == zones[z].nfree);
+        nfree += zone_nfree;
+    }
+
+    assert(nfree > 0);
+    cprintf(COLOR_BLUE"check_buddy_free_lists() succeeded!\n"COLOR_NONE);
+}
+
 static void check_page_alloc_b()
 {
     physaddr_t pa, pa0, pa1, pa2;
@@ -984,13 +3626,15 @@ static void check_page_alloc_b()
     assert(pa0 != OUT_OF_MEM);
     assert(pa1 != OUT_OF_MEM && pa1 != pa0);
     assert(pa2 != OUT_OF_MEM && pa2 != pa1 && pa2 != pa0);
-    assert(pa0 < npages * PGSIZE);
-    assert(pa1 < npages * PGSIZE);
-    assert(pa2 < npages * PGSIZE);
+    assert(PGNUM(pa0) < npages);
+    assert(PGNUM(pa1) < npages);
+    assert(PGNUM(pa2) < npages);
+
+    // there's no block of 0 pages
+    assert(kmalloc(0) == OUT_OF_MEM);
 
     // temporarily steal the rest of the free pages
-    t0 = pages_b->tree[0];
-    pages_b->tree[0] = 0;
+    t0 = buddy_steal();
 
     // should be no free memory
     assert(kmalloc(1) == OUT_OF_MEM);
@@ -1016,19 +3660,502 @@ static void check_page_alloc_b()
     // SKIP, kmalloc won't initialize memory
 
     // give free list back
-    pages_b->tree[0] = t0;
+    buddy_give_back(t0);
 
     // free the pages we took
     kfree(pa0);
     kfree(pa1);
     kfree(pa2);
 
+    // cached single pages merge again for a larger block, only in free-list
+    // mode as merging in the tree finds the stolen memory again
+    if (use_buddy_lists) {
+        assert((pa = kmalloc_block(2)) != OUT_OF_MEM);
+        buddy_split_pages(PGNUM(pa), 1);
+        t0 = buddy_steal();
+        kfree_block(pa);
+        kfree_block(pa + PGSIZE);
+        assert(kmalloc_block(2) == pa);
+        kfree_block(pa);
+        buddy_give_back(t0);
+    }
+
     // number of free pages should be the same
     // SKIP, hard to detect free pages
 
     cprintf(COLOR_BLUE"check_page_alloc() succeeded!\n"COLOR_NONE);
 }
 
+// Fill memory with blocks of size pages, chained through their first pages,
+// and free them again. Returns how many fit, and the free pages that were
+// left in *left. A block of fit pages, unless 0, must still fit then.
+static uint32_t kmalloc_fill(uint32_t size, uint32_t fit, uint32_t *left)
+{
+    physaddr_t head = OUT_OF_MEM, pa;
+    uint32_t nblocks = 0;
+
+    while ((pa = kmalloc(size)) != OUT_OF_MEM) {
+        *(physaddr_t *) KADDR(pa) = head;
+        head = pa;
+        nblocks++;
+    }
+    *left = buddy_nfree();
+    if (fit) {
+        assert((pa = kmalloc(fit)) != OUT_OF_MEM);
+        kfree(pa);
+    }
+    for (; head != OUT_OF_MEM; head = pa) {
+        pa = *(physaddr_t *) KADDR(head);
+        kfree(head);
+    }
+    return nblocks;
+}
+
+//
+// Check that kmalloc() of any number of pages takes exactly that many pages,
+// and measure how much that saves compared with rounding up to a power of 2,
+// by running the same allocations with the sizes rounded up.
+//
+static void check_kmalloc_trim()
+{
+    static const uint32_t sizes[] = { 3, 5, 6, 7, 9, 12, 17, 31, 33, 100 };
+    const uint32_t n = sizeof(sizes) / sizeof(sizes[0]);
+    physaddr_t pas[sizeof(sizes) / sizeof(sizes[0])];
+    // only the memory set up so far, that nfree counts, cached pages too as
+    // they're given back when running out
+    uint32_t end = page_init_hold();
+    page_caches_drain();
+    uint32_t nfree = buddy_nfree(), asked = 0, rounded;
+    uint32_t i, j;
+
+    for (i = 0; i < n; i++) {
+        uint32_t block = up_to_power_of_2(sizes[i] - 1);
+        assert((pas[i] = kmalloc(sizes[i])) != OUT_OF_MEM);
+        assert(PGNUM(pas[i]) % block == 0);
+        assert(!buddy_is_single(pas[i]));
+        for (j = 0; j < sizes[i]; j++)
+            *(uint32_t *) KADDR(pas[i] + j * PGSIZE) = i;
+        asked += sizes[i];
+    }
+    assert(nfree - buddy_nfree() == asked);
+
+    // nobody overlaps
+    for (i = 0; i < n; i++)
+        for (j = 0; j < sizes[i]; j++)
+            assert(*(uint32_t *) KADDR(pas[i] + j * PGSIZE) == i);
+
+    for (i = 0; i < n; i++)
+        kfree(pas[i]);
+    assert(buddy_nfree() == nfree);
+    if (use_buddy_lists) check_buddy_free_lists();
+
+    // the same sizes rounded up
+    for (i = 0; i < n; i++)
+        assert((pas[i] = kmalloc(up_to_power_of_2(sizes[i] - 1))) != OUT_OF_MEM);
+    rounded = nfree - buddy_nfree();
+    for (i = 0; i < n; i++)
+        kfree(pas[i]);
+    assert(buddy_nfree() == nfree);
+
+    // Fill memory with 5-page blocks, whose trimmed tails are left for
+    // smaller requests, then with the 8-page blocks that rounding up would
+    // take for them.
+    uint32_t left, left_rounded;
+    uint32_t nblocks = kmalloc_fill(5, 2, &left);
+    assert(left == nfree - 5 * nblocks);
+    assert(buddy_nfree() == nfree);
+    uint32_t nblocks_rounded = kmalloc_fill(8, 0, &left_rounded);
+    assert(buddy_nfree() == nfree);
+
+    cprintf("kmalloc trimming: %u pages instead of %u for %u blocks, "
+            "%u 5-page blocks fit instead of %u, leaving %u pages instead of %u\n",
+            asked, rounded, n, nblocks, nblocks_rounded, left, left_rounded);
+    page_init_release(end);
+
+    cprintf(COLOR_BLUE"check_kmalloc_trim() succeeded!\n"COLOR_NONE);
+}
+
+
+//
+// Check allocations below an address or at an alignment, and that ordinary
+// ones leave the reserve of the DMA zone alone.
+//
+static void check_kmalloc_constrained()
+{
+    struct Zone *dma = &zones[ZONE_DMA], *normal = &zones[ZONE_NORMAL];
+    physaddr_t pa0, pa1, pa2, head, pa;
+    // only the memory set up so far, that nfree counts, cached pages too
+    uint32_t end = page_init_hold();
+    page_caches_drain();
+    uint32_t dma_free = dma->nfree, nfree = buddy_nfree();
+
+    // page 0 is never free, and nothing fits below it
+    assert(kmalloc_constrained(1, PGSIZE, PGSIZE) == OUT_OF_MEM);
+    assert(kmalloc_constrained(1, PGSIZE - 1, PGSIZE) == OUT_OF_MEM);
+
+    assert((pa0 = kmalloc_constrained(3, ZONE_DMA_LIMIT, PGSIZE)) != OUT_OF_MEM);
+    assert(pa0 + 3 * PGSIZE <= ZONE_DMA_LIMIT);
+    assert(dma->nfree == dma_free - 3);
+
+    assert((pa1 = kmalloc_constrained(5, 4 * PGSIZE * 1024, 32 * PGSIZE)) != OUT_OF_MEM);
+    assert(pa1 % (32 * PGSIZE) == 0 && pa1 + 5 * PGSIZE <= 4 * PGSIZE * 1024);
+
+    // at a large page boundary, from the highest zone
+    assert((pa2 = kmalloc_constrained(2, ~0, PTSIZE)) != OUT_OF_MEM);
+    assert(pa2 % PTSIZE == 0);
+    assert(normal->hi - normal->lo < PTSIZE / PGSIZE || pa2 >= ZONE_DMA_LIMIT);
+    assert(nfree - buddy_nfree() == 3 + 5 + 2);
+
+    kfree(pa0);
+    kfree(pa1);
+    kfree(pa2);
+    assert(buddy_nfree() == nfree && dma->nfree == dma_free);
+
+    // Ordinary allocations stop at the reserve, which is still there for
+    // constrained ones. Chain the blocks through their first pages.
+    head = OUT_OF_MEM;
+    while ((pa = kmalloc(2)) != OUT_OF_MEM) {
+        *(physaddr_t *) KADDR(pa) = head;
+        head = pa;
+    }
+    assert(dma->nfree >= dma->reserve);
+    if (dma->reserve >= 16) {
+        assert((pa0 = kmalloc_constrained(2, ZONE_DMA_LIMIT, PGSIZE)) != OUT_OF_MEM);
+        kfree(pa0);
+    }
+    for (; head != OUT_OF_MEM; head = pa) {
+        pa = *(physaddr_t *) KADDR(head);
+        kfree(head);
+    }
+    assert(buddy_nfree() == nfree && dma->nfree == dma_free);
+    if (use_buddy_lists) check_buddy_free_lists();
+    page_init_release(end);
+
+    cprintf(COLOR_BLUE"check_kmalloc_constrained() succeeded!\n"COLOR_NONE);
+}
+
+//
+// Check that zeroed pages come from the pool when there are some, and are
+// zeroed on the spot otherwise.
+//
+static void check_zero_pool()
+{
+    struct ZeroPool saved = zero_pool;
+    physaddr_t pa, pa0;
+    uint32_t i;
+    char *c;
+
+    // idle calls fill the pool up to the target and no further
+    for (i = 0; i < zero_pool_target + 8; i++)
+        page_zero_idle();
+    assert(zero_pool.count == zero_pool_target);
+    assert(zero_pool.refills - saved.refills == zero_pool_target - saved.count);
+
+    assert((pa = kmalloc_page(ALLOC_ZERO)) != OUT_OF_MEM);
+    assert(zero_pool.hits == saved.hits + 1);
+    for (c = KADDR(pa), i = 0; i < PGSIZE; i++)
+        assert(c[i] == 0);
+    kfree(pa);
+
+    // dirty a page, the magazine hands it out again once the pool is empty
+    while (zero_pool.count)
+        kfree_block(zero_pool.pages[--zero_pool.count]);
+    assert((pa0 = kmalloc(1)) != OUT_OF_MEM);
+    memset(KADDR(pa0), 1, PGSIZE);
+    kfree(pa0);
+    assert((pa = kmalloc_page(ALLOC_ZERO)) == pa0);
+    assert(zero_pool.misses == saved.misses + 1);
+    for (c = KADDR(pa), i = 0; i < PGSIZE; i++)
+        assert(c[i] == 0);
+    kfree(pa);
+
+    // pooled pages are given up when out of memory, put two of them back
+    // once buddy_steal() has taken the rest
+    page_zero_idle();
+    page_zero_idle();
+    assert(zero_pool.count >= 2);
+    pa0 = zero_pool.pages[--zero_pool.count];
+    pa = zero_pool.pages[--zero_pool.count];
+    uint32_t t0 = buddy_steal();
+    zero_pool.pages[zero_pool.count++] = pa;
+    zero_pool.pages[zero_pool.count++] = pa0;
+    assert(kmalloc(1) == pa0 && zero_pool.count == 1);
+    assert(kmalloc(1) == pa && zero_pool.count == 0);
+    assert(kmalloc(1) == OUT_OF_MEM);
+    kfree(pa0);
+    kfree(pa);
+    buddy_give_back(t0);
+
+    cprintf(COLOR_BLUE"check_zero_pool() succeeded!\n"COLOR_NONE);
+}
+
+//
+// Check that pages allocated in bulk are just like single pages.
+//
+static void check_kmalloc_bulk()
+{
+    static physaddr_t pas[300];
+    uint32_t nfree, i, t0;
+
+    // count the pages cached by the magazine as free
+    page_mag_drain(this_page_mag(), 0);
+    nfree = buddy_nfree();
+
+    assert(kmalloc_bulk(pas, 0, 0) == 0);
+    assert(kmalloc_bulk(pas, 300, 0) == 300);
+    assert(nfree - buddy_nfree() == 300);
+    for (i = 0; i < 300; i++) {
+        assert(PGOFF(pas[i]) == 0 && PGNUM(pas[i]) < npages);
+        assert(buddy_is_single(pas[i]));
+        assert(i == 0 || pas[i] != pas[i - 1]);
+        *(uint32_t *) KADDR(pas[i]) = i;
+    }
+
+    // nobody overlaps
+    for (i = 0; i < 300; i++)
+        assert(*(uint32_t *) KADDR(pas[i]) == i);
+
+    // any of them can be freed alone, the others out of order, merging all
+    // the way back
+    kfree(pas[17]);
+    pas[17] = pas[299];
+    kfree_bulk(pas + 150, 149);
+    kfree_bulk(pas, 150);
+    page_mag_drain(this_page_mag(), 0);
+    assert(buddy_nfree() == nfree);
+    if (use_buddy_lists) check_buddy_free_lists();
+
+    // zeroed pages come from the pool first and are charged to the owner,
+    // and the magazine takes them back as kfree() would, up to mag_high
+    struct PageMag *mag = this_page_mag();
+    uint32_t hits = zero_pool.hits, tables = owner_pages[OWNER_PGTABLE];
+    for (i = 0; i < zero_pool_target; i++)
+        page_zero_idle();
+    assert(kmalloc_bulk(pas, 300, ALLOC_ZERO | ALLOC_OWNER(OWNER_PGTABLE)) == 300);
+    assert(zero_pool.hits - hits == MIN(zero_pool_target, 300) || !use_zero_pool);
+    assert(owner_pages[OWNER_PGTABLE] - tables == 300);
+    for (i = 0; i < 300; i++)
+        assert(*(uint32_t *) KADDR(pas[i]) == 0);
+    bool cached = page_mag_takes(pas[0]);
+    assert(mag->count == 0);
+    kfree_bulk(pas, 300);
+    assert(mag->count <= mag_high && (!cached || mag->count > 0));
+    assert(owner_pages[OWNER_PGTABLE] == tables);
+    page_caches_drain();
+    assert(buddy_nfree() == nfree);
+
+    // a partial batch when running short, only in free-list mode as merging
+    // in the tree finds the stolen memory again
+    assert((pas[0] = kmalloc(1)) != OUT_OF_MEM);
+    t0 = buddy_steal();
+    assert(kmalloc_bulk(pas + 1, 8, 0) == 0);
+    kfree_bulk(pas, 1);
+    if (use_buddy_lists) {
+        assert(kmalloc_bulk(pas + 1, 8, 0) == 1 && pas[1] == pas[0]);
+        kfree_bulk(pas, 1);
+    }
+    buddy_give_back(t0);
+
+    cprintf(COLOR_BLUE"check_kmalloc_bulk() succeeded!\n"COLOR_NONE);
+}
+
+//
+// Check that every way in and out of the allocator charges the right owner.
+//
+static void check_page_owners()
+{
+    uint32_t saved[OWNER_ENV(2)];
+    physaddr_t pa, pas[5];
+    uint32_t i;
+
+    memcpy(saved, owner_pages, sizeof(saved));
+
+    // the whole trimmed block, however it's freed
+    assert((pa = kmalloc(3)) != OUT_OF_MEM);
+    assert(page_desc(pa)->pd_owner == OWNER_KERNEL);
+    assert(owner_pages[OWNER_KERNEL] == saved[OWNER_KERNEL] + 3);
+    kfree(pa);
+    assert((pa = kmalloc_constrained(5, ~0, 8 * PGSIZE)) != OUT_OF_MEM);
+    assert(owner_pages[OWNER_KERNEL] == saved[OWNER_KERNEL] + 5);
+    kfree(pa);
+    assert(owner_pages[OWNER_KERNEL] == saved[OWNER_KERNEL]);
+
+    assert((pa = kmalloc_page(ALLOC_ZERO | ALLOC_OWNER(OWNER_ENV(1)))) != OUT_OF_MEM);
+    assert(page_desc(pa)->pd_owner == OWNER_ENV(1));
+    assert(owner_pages[OWNER_ENV(1)] == saved[OWNER_ENV(1)] + 1);
+    page_set_owner(pa, OWNER_USER);
+    assert(owner_pages[OWNER_ENV(1)] == saved[OWNER_ENV(1)]);
+    assert(owner_pages[OWNER_USER] == saved[OWNER_USER] + 1);
+    kfree(pa);
+    assert(owner_pages[OWNER_USER] == saved[OWNER_USER]);
+
+    assert(kmalloc_bulk(pas, 5, 0) == 5);
+    page_set_owner(pas[2], OWNER_PGTABLE);
+    assert(owner_pages[OWNER_KERNEL] == saved[OWNER_KERNEL] + 4);
+    assert(owner_pages[OWNER_PGTABLE] == saved[OWNER_PGTABLE] + 1);
+    kfree_bulk(pas, 5);
+
+    // pages cached on the way belong to nobody
+    for (i = 0; i < OWNER_ENV(2); i++)
+        assert(owner_pages[i] == saved[i]);
+
+    cprintf(COLOR_BLUE"check_page_owners() succeeded!\n"COLOR_NONE);
+}
+
+static void check_buddy_lazy()
+{
+    uint32_t nfree, pn, z, hits = buddy_lazy_hits, forced = buddy_lazy_forced;
+    bool lazy = use_buddy_lazy;
+    physaddr_t pa;
+
+    // whether it's on or not, and start with nothing left unmerged
+    use_buddy_lazy = true;
+    page_mag_drain(this_page_mag(), 0);
+    for (z = 0; z < NZONES; z++)
+        buddy_coalesce(z);
+    nfree = buddy_nfree();
+    forced = buddy_lazy_forced;
+
+    // two single pages that are buddies
+    assert((pa = kmalloc_block(2)) != OUT_OF_MEM);
+    pn = PGNUM(pa);
+    z = zone_of(pn);
+    buddy_split_pages(pn, 1);
+
+    // the first one freed has nothing to merge with, the second one is
+    // left unmerged
+    kfree_lists(pa);
+    assert(buddy_tag(pn) == (BUDDY_TAG_FREE | 0));
+    kfree_lists(pa + PGSIZE);
+    assert(buddy_tag(pn + 1) == (BUDDY_TAG_FREE | BUDDY_TAG_LAZY | 0));
+    check_buddy_free_lists();
+
+    // and comes back as it is
+    assert(kmalloc_lists(1, 0, z, 0, npages) == pa + PGSIZE);
+    assert(buddy_lazy_hits == hits + 1);
+    kfree_lists(pa + PGSIZE);
+
+    // merging unmerged blocks on demand
+    assert(buddy_coalesce(z) > 0);
+    assert(buddy_lazy_forced > forced);
+    assert(!(buddy_tag(pn) & BUDDY_TAG_FREE) ||
+            BUDDY_TAG_ORDER(buddy_tag(pn)) > 0);
+    assert(!(buddy_tag(pn + 1) & BUDDY_TAG_FREE));
+    assert(buddy_nfree() == nfree);
+    check_buddy_free_lists();
+
+    // nothing is left unmerged if it's off
+    use_buddy_lazy = lazy;
+    if (!lazy)
+        for (z = 0; z < NZONES; z++)
+            buddy_coalesce(z);
+
+    cprintf(COLOR_BLUE"check_buddy_lazy() succeeded!\n"COLOR_NONE);
+}
+
+#ifdef BUDDY_COMPACT
+//
+// Check that the tag bitmaps give every kind of tag back, and take a few
+// bits per page, bounded by npages.
+//
+static void check_buddy_compact()
+{
+    physaddr_t pa;
+    uint32_t pn, i;
+
+    assert(sizeof(struct PageDesc) == 4);
+    assert(buddy_tag_bytes <= npages * 3 / 8 + (buddy_max_order + 2) * 2 * sizeof(uint32_t));
+
+    assert((pa = kmalloc_block(8)) != OUT_OF_MEM);
+    pn = PGNUM(pa);
+    assert(buddy_tag(pn) == 3 && buddy_tag(pn + 1) == 0 && buddy_tag(pn + 4) == 0);
+    buddy_set_tag(pn, BUDDY_TAG_CONT | 3);
+    assert(buddy_tag(pn) == (BUDDY_TAG_CONT | 3));
+    buddy_set_tag(pn, 3);
+
+    // single pages, one of them in a magazine
+    buddy_split_pages(pn, 3);
+    for (i = 0; i < 8; i++)
+        assert(buddy_tag(pn + i) == 0);
+    buddy_set_tag(pn + 5, BUDDY_TAG_CACHED);
+    assert(buddy_tag(pn + 5) == BUDDY_TAG_CACHED);
+    assert(buddy_tag(pn + 4) == 0 && buddy_tag(pn + 6) == 0);
+    buddy_set_tag(pn + 5, 0);
+
+    // merged back whole
+    for (i = 0; i < 8; i++)
+        kfree_lists(pa + i * PGSIZE);
+    check_buddy_free_lists();
+
+    cprintf(COLOR_BLUE"check_buddy_compact() succeeded!\n"COLOR_NONE);
+}
+#endif
+
+// check the bitmap allocator, and the mapping functions on top of it
+static void check_page_bitmap(void)
+{
+    uint32_t summary[BITMAP_SUMMARY_WORDS];
+    physaddr_t pas[64];
+    uint32_t i, n = sizeof(pas) / sizeof(pas[0]), nfree = bitmap_nfree, end;
+
+    // pages come lowest first
+    for (i = 0; i < n; i++) {
+        assert((pas[i] = page_bitmap_alloc(0)) != OUT_OF_MEM);
+        assert(!bitmap_is_free(PGNUM(pas[i])));
+        assert(i == 0 || pas[i] > pas[i - 1]);
+    }
+    assert(bitmap_nfree == nfree - n);
+
+    // so a freed page is the next one to come back
+    page_bitmap_free(pas[10]);
+    assert(bitmap_is_free(PGNUM(pas[10])));
+    assert(page_bitmap_alloc(0) == pas[10]);
+
+    // temporarily steal the rest of the free pages
+    memcpy(summary, bitmap_summary, sizeof(summary));
+    memset(bitmap_summary, 0, sizeof(summary));
+    end = page_init_hold();
+    assert(page_bitmap_alloc(0) == OUT_OF_MEM);
+
+    // there is no free memory, so we can't allocate a page table
+    assert(page_insert_pa(kern_pgdir, pas[1], 0x0, PTE_W) < 0);
+
+    // free pas[0] and try again: pas[0] should be used for page table
+    page_bitmap_free(pas[0]);
+    assert(page_insert_pa(kern_pgdir, pas[1], 0x0, PTE_W) == 0);
+    assert(PTE_ADDR(kern_pgdir[0]) == pas[0]);
+    assert(check_va2pa(kern_pgdir, 0x0) == pas[1]);
+    assert(bitmap_refs[PGNUM(pas[0])] == 1);
+    assert(bitmap_refs[PGNUM(pas[1])] == 1);
+
+    // mapping it twice takes two references
+    assert(page_insert_pa(kern_pgdir, pas[1], (void*) PGSIZE, PTE_W) == 0);
+    assert(bitmap_refs[PGNUM(pas[1])] == 2);
+
+    // unmapping the last one frees it
+    page_remove(kern_pgdir, 0x0);
+    assert(check_va2pa(kern_pgdir, 0x0) == ~0);
+    assert(bitmap_refs[PGNUM(pas[1])] == 1 && !bitmap_is_free(PGNUM(pas[1])));
+    page_remove(kern_pgdir, (void*) PGSIZE);
+    assert(bitmap_refs[PGNUM(pas[1])] == 0 && bitmap_is_free(PGNUM(pas[1])));
+    assert(page_bitmap_alloc(0) == pas[1]);
+
+    // forcibly take pas[0] back
+    kern_pgdir[0] = 0;
+    assert(bitmap_refs[PGNUM(pas[0])] == 1);
+    bitmap_refs[PGNUM(pas[0])] = 0;
+
+    // give free pages back
+    for (i = 0; i < BITMAP_SUMMARY_WORDS; i++)
+        bitmap_summary[i] |= summary[i];
+    page_init_release(end);
+
+    for (i = 0; i < n; i++)
+        page_bitmap_free(pas[i]);
+    assert(bitmap_nfree == nfree);
+
+    cprintf(COLOR_BLUE"check_page_bitmap() succeeded!\n"COLOR_NONE);
+}
 
 //
 // Checks that the kernel part of virtual address space
@@ -1039,22 +4166,27 @@ static void check_page_alloc_b()
 //
 
 static void
-check_kern_pgdir(void)
+check_kern_pgdir(void *meta, size_t upages_bytes)
 {
 	uint32_t i, n;
 	pde_t *pgdir;
 
 	pgdir = kern_pgdir;
 
-	// check pages array
-	n = ROUNDUP(npages*sizeof(struct PageInfo), PGSIZE);
+	// check page metadata, all of it and nothing after it
+	n = ROUNDUP(upages_bytes, PGSIZE);
+	assert(n <= UPAGES_SIZE);
 	for (i = 0; i < n; i += PGSIZE)
-		assert(check_va2pa(pgdir, UPAGES + i) == PADDR(pages) + i);
+		assert(check_va2pa(pgdir, UPAGES + i) == PADDR(meta) + i);
+	for (; i < UPAGES_SIZE; i += PGSIZE)
+		assert(check_va2pa(pgdir, UPAGES + i) == ~0);
 
 
-	// check phys mem
-	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
+	// check phys mem, and that high memory isn't mapped yet
+	for (i = 0; i < npages_low * PGSIZE; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
+	for (i = 0; i < PTSIZE; i += PGSIZE)
+		assert(check_va2pa(pgdir, KMAPBASE + i) == ~0);
 
 	// check kernel stack
 	for (i = 0; i < KSTKSIZE; i += PGSIZE)
@@ -1063,10 +4195,16 @@ check_kern_pgdir(void)
 
 	// check PDE permissions
 	for (i = 0; i < NPDENTRIES; i++) {
+		if (i >= PDX(UVPT) && i < PDX(UVPT) + UVPTSIZE / PTSIZE) {
+			assert(pgdir[i] == ((PADDR(pgdir) + (i - PDX(UVPT)) * PGSIZE) | PTE_U | PTE_P));
+			continue;
+		}
+		if (i >= PDX(UPAGES) && i <= PDX(UPAGES + n - 1)) {
+			assert(pgdir[i] & PTE_P);
+			continue;
+		}
 		switch (i) {
-		case PDX(UVPT):
 		case PDX(KSTACKTOP-1):
-		case PDX(UPAGES):
 			assert(pgdir[i] & PTE_P);
 			break;
 		default:
@@ -1081,48 +4219,6 @@ check_kern_pgdir(void)
 	cprintf(COLOR_BLUE"check_kern_pgdir() succeeded!\n"COLOR_NONE);
 }
 
-static void check_kern_pgdir_b()
-{
-    uint32_t i, n;
-    pde_t *pgdir;
-
-    pgdir = kern_pgdir;
-
-    // check pages array
-    //n = ROUNDUP(npages*sizeof(struct PageInfo), PGSIZE);
-    //for (i = 0; i < n; i += PGSIZE)
-    //	assert(check_va2pa(pgdir, UPAGES + i) == PADDR(pages) + i);
-
-    // check phys mem
-    for (i = 0; i < npages * PGSIZE; i += PGSIZE)
-        assert(check_va2pa(pgdir, KERNBASE + i) == i);
-
-    // check kernel stack
-    for (i = 0; i < KSTKSIZE; i += PGSIZE)
-        assert(check_va2pa(pgdir, KSTACKTOP - KSTKSIZE + i) == PADDR(bootstack) + i);
-    assert(check_va2pa(pgdir, KSTACKTOP - PTSIZE) == ~0);
-
-    // check PDE permissions
-    for (i = 0; i < NPDENTRIES; i++) {
-        switch (i) {
-            case PDX(UVPT):
-            case PDX(KSTACKTOP-1):
-            case PDX(UPAGES):
-                assert(pgdir[i] & PTE_P);
-                break;
-            default:
-                if (i >= PDX(KERNBASE)) {
-                    assert(pgdir[i] & PTE_P);
-                    assert(pgdir[i] & PTE_W);
-                } else
-                    assert(pgdir[i] == 0);
-                break;
-        }
-    }
-    cprintf(COLOR_BLUE"check_kern_pgdir() succeeded!\n"COLOR_NONE);
-}
-
-
 // This function returns the physical address of the page containing 'va',
 // defined by the page directory 'pgdir'.  The hardware normally performs
 // this functionality for us!  We define our own version to help check
@@ -1166,6 +4262,7 @@ check_page(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
 	struct PageInfo *fl;
+	uint32_t end;
 	pte_t *ptep, *ptep1;
 	void *va;
 	int i;
@@ -1184,6 +4281,7 @@ check_page(void)
 	// temporarily steal the rest of the free pages
 	fl = page_free_list;
 	page_free_list = 0;
+	end = page_init_hold();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1304,6 +4402,7 @@ check_page(void)
 
 	// give free list back
 	page_free_list = fl;
+	page_init_release(end);
 
 	// free the pages we took
 	page_free(pp0);
@@ -1332,28 +4431,27 @@ void check_page_b()
     assert(pa2 != OUT_OF_MEM && pa2 != pa1 && pa2 != pa0);
 
     // temporarily steal the rest of the free pages
-    t0 = pages_b->tree[0];
-    pages_b->tree[0] = 0;
+    t0 = buddy_steal();
 
     // should be no free memory
     assert(kmalloc(1) == OUT_OF_MEM);
 
     // there is no page allocated at address 0
-    assert(page_lookup_b(kern_pgdir, (void *) 0x0, &ptep) == ADDR_UNAVAIL);
+    assert(page_lookup_pa(kern_pgdir, (void *) 0x0, &ptep) == ADDR_UNAVAIL);
 
     // there is no free memory, so we can't allocate a page table
-    assert(page_insert_b(kern_pgdir, pa1, 0x0, PTE_W) < 0);
+    assert(page_insert_pa(kern_pgdir, pa1, 0x0, PTE_W) < 0);
 
     // free pa0 and try again: pa0 should be used for page table
     kfree(pa0);
-    assert(page_insert_b(kern_pgdir, pa1, 0x0, PTE_W) == 0);
+    assert(page_insert_pa(kern_pgdir, pa1, 0x0, PTE_W) == 0);
     assert(PTE_ADDR(kern_pgdir[0]) == pa0);
     assert(check_va2pa(kern_pgdir, 0x0) == pa1);
     assert(BUDDY_GET_REF(pages_b, pa1) == 1);
     assert(BUDDY_GET_REF(pages_b, pa0) == 1);
 
     // should be able to map pp2 at PGSIZE because pp0 is already allocated for page table
-    assert(page_insert_b(kern_pgdir, pa2, (void*) PGSIZE, PTE_W) == 0);
+    assert(page_insert_pa(kern_pgdir, pa2, (void*) PGSIZE, PTE_W) == 0);
     assert(check_va2pa(kern_pgdir, PGSIZE) == pa2);
     assert(BUDDY_GET_REF(pages_b, pa2) == 1);
 
@@ -1361,7 +4459,7 @@ void check_page_b()
     // SKIP, stolen memory is discovered
 
     // should be able to map pa2 at PGSIZE because it's alread there
-    assert(page_insert_b(kern_pgdir, pa2, (void*) PGSIZE, PTE_W) == 0);
+    assert(page_insert_pa(kern_pgdir, pa2, (void*) PGSIZE, PTE_W) == 0);
     assert(check_va2pa(kern_pgdir, PGSIZE) == pa2);
     assert(BUDDY_GET_REF(pages_b, pa2) == 1);
 
@@ -1374,14 +4472,14 @@ void check_page_b()
     assert(pgdir_walk(kern_pgdir, (void*)PGSIZE, 0) == ptep+PTX(PGSIZE));
 
     // should be able to change permissions too.
-    assert(page_insert_b(kern_pgdir, pa2, (void*) PGSIZE, PTE_W|PTE_U) == 0);
+    assert(page_insert_pa(kern_pgdir, pa2, (void*) PGSIZE, PTE_W|PTE_U) == 0);
     assert(check_va2pa(kern_pgdir, PGSIZE) == pa2);
     assert(BUDDY_GET_REF(pages_b, pa2) == 1);
     assert(*pgdir_walk(kern_pgdir, (void*) PGSIZE, 0) & PTE_U);
     assert(kern_pgdir[0] & PTE_U);
 
     // should be able to remap with fewer permissions
-    assert(page_insert_b(kern_pgdir, pa2, (void*) PGSIZE, PTE_W) == 0);
+    assert(page_insert_pa(kern_pgdir, pa2, (void*) PGSIZE, PTE_W) == 0);
     assert(*pgdir_walk(kern_pgdir, (void*) PGSIZE, 0) & PTE_W);
     assert(!(*pgdir_walk(kern_pgdir, (void*) PGSIZE, 0) & PTE_U));
 
@@ -1389,7 +4487,7 @@ void check_page_b()
     // SKIP, enough memory
 
     // insert pa1 at PGSIZE (replacing pa2)
-    assert(page_insert_b(kern_pgdir, pa1, (void*) PGSIZE, PTE_W) == 0);
+    assert(page_insert_pa(kern_pgdir, pa1, (void*) PGSIZE, PTE_W) == 0);
     assert(!(*pgdir_walk(kern_pgdir, (void*) PGSIZE, 0) & PTE_U));
 
     // should have pa1 at both 0 and PGSIZE, pa2 nowhere, ...
@@ -1403,19 +4501,19 @@ void check_page_b()
     assert((pa = kmalloc(1)) && pa == pa2);
 
     // unmapping pa1 at 0 should keep pa1 at PGSIZE
-    page_remove_b(kern_pgdir, 0x0);
+    page_remove(kern_pgdir, 0x0);
     assert(check_va2pa(kern_pgdir, 0x0) == ~0);
     assert(check_va2pa(kern_pgdir, PGSIZE) == pa1);
     assert(BUDDY_GET_REF(pages_b, pa1) == 1);
     assert(BUDDY_GET_REF(pages_b, pa2) == 0);
 
     // test re-inserting pa1 at PGSIZE
-    assert(page_insert_b(kern_pgdir, pa1, (void*) PGSIZE, 0) == 0);
+    assert(page_insert_pa(kern_pgdir, pa1, (void*) PGSIZE, 0) == 0);
     assert(BUDDY_GET_REF(pages_b, pa1));
     //assert(pa1->pa_link == NULL);
 
     // unmapping pa1 at PGSIZE should free it
-    page_remove_b(kern_pgdir, (void*) PGSIZE);
+    page_remove(kern_pgdir, (void*) PGSIZE);
     assert(check_va2pa(kern_pgdir, 0x0) == ~0);
     assert(check_va2pa(kern_pgdir, PGSIZE) == ~0);
     assert(BUDDY_GET_REF(pages_b, pa1) == 0);
@@ -1453,7 +4551,7 @@ void check_page_b()
     BUDDY_CLR_REF(pages_b, pa0);
 
     // give free list back
-    pages_b->tree[0] = t0;
+    buddy_give_back(t0);
 
     // free the pages we took
     kfree(pa0);
@@ -1463,84 +4561,393 @@ void check_page_b()
     cprintf(COLOR_BLUE"check_page() succeeded!\n"COLOR_NONE);
 }
 
-// check page_insert, page_remove, &c, with an installed kern_pgdir
-static void
-check_page_installed_pgdir(void)
+//
+// Check mapping a block with a large page.
+//
+static void check_page_large()
 {
-	struct PageInfo *pp, *pp0, *pp1, *pp2;
-	struct PageInfo *fl;
-	pte_t *ptep, *ptep1;
-	uintptr_t va;
-	int i;
+    uint32_t tables = owner_pages[OWNER_PGTABLE], i;
+    void *va = (void *) (2 * PGSIZE_PSE);
+    physaddr_t pa, pa1, pa2;
+    pte_t *ptep;
 
-	// check that we can read and write installed pages
-	pp1 = pp2 = 0;
-	assert((pp0 = page_alloc(0)));
-	assert((pp1 = page_alloc(0)));
-	assert((pp2 = page_alloc(0)));
-	page_free(pp0);
-	memset(page2kva(pp1), 1, PGSIZE);
-	memset(page2kva(pp2), 2, PGSIZE);
-	page_insert(kern_pgdir, pp1, (void*) PGSIZE, PTE_W);
-	assert(pp1->pp_ref == 1);
-	assert(*(uint32_t *)PGSIZE == 0x01010101U);
-	page_insert(kern_pgdir, pp2, (void*) PGSIZE, PTE_W);
-	assert(*(uint32_t *)PGSIZE == 0x02020202U);
-	assert(pp2->pp_ref == 1);
-	assert(pp1->pp_ref == 0);
-	*(uint32_t *)PGSIZE = 0x03030303U;
-	assert(*(uint32_t *)page2kva(pp2) == 0x03030303U);
-	page_remove(kern_pgdir, (void*) PGSIZE);
-	assert(pp2->pp_ref == 0);
+    assert((pa1 = kmalloc(1)) != OUT_OF_MEM);
+    assert((pa = kmalloc(PGSIZE_PSE / PGSIZE)) != OUT_OF_MEM);
+    assert(PGOFF_PSE(pa) == 0);
+    pmem->incref(pa1);
+    pmem->incref(pa);
+
+    if (!use_pse) {
+        assert(page_insert_large(kern_pgdir, pa, va, PTE_W) == -E_INVAL);
+        goto out;
+    }
 
-	// forcibly take pp0 back
-	assert(PTE_ADDR(kern_pgdir[0]) == page2pa(pp0));
-	kern_pgdir[0] = 0;
-	assert(pp0->pp_ref == 1);
-	pp0->pp_ref = 0;
+    // both must be aligned
+    assert(page_insert_large(kern_pgdir, pa + PGSIZE, va, PTE_W) == -E_INVAL);
+    assert(page_insert_large(kern_pgdir, pa, va + PGSIZE, PTE_W) == -E_INVAL);
+
+    // a whole block, not a single page where one could begin
+    assert((pa2 = kmalloc_block(PGSIZE_PSE / PGSIZE)) != OUT_OF_MEM);
+    buddy_split_pages(PGNUM(pa2), PGSHIFT_PSE - PGSHIFT);
+    assert(page_insert_large(kern_pgdir, pa2, va, PTE_W) == -E_INVAL);
+    for (i = 0; i < PGSIZE_PSE / PGSIZE; i++)
+        kfree_block(pa2 + i * PGSIZE);
+
+    // a page table in use is in the way, an empty one is given up
+    assert(page_insert_pa(kern_pgdir, pa1, va + PGSIZE, PTE_W) == 0);
+    assert(owner_pages[OWNER_PGTABLE] == tables + 1);
+    assert(page_insert_large(kern_pgdir, pa, va, PTE_W) == -E_INVAL);
+    page_remove(kern_pgdir, va + PGSIZE);
+    assert(page_insert_large(kern_pgdir, pa, va, PTE_W) == 0);
+    assert(owner_pages[OWNER_PGTABLE] == tables);
+    assert(kern_pgdir[PDX(va)] == (pa | PTE_PS | PTE_W | PTE_P));
+    assert(BUDDY_GET_REF(pages_b, pa) == 2 && page_desc(pa)->pd_mapcount == 1);
+
+    // one entry maps all of it
+    assert(check_va2pa(kern_pgdir, (uintptr_t) va + 5 * PGSIZE) == pa + 5 * PGSIZE);
+    assert(page_lookup_pa(kern_pgdir, va + 5 * PGSIZE, &ptep) == pa + 5 * PGSIZE);
+    assert(ptep == (pte_t *) &kern_pgdir[PDX(va)]);
+
+    // small pages can't go inside while others use the block
+    assert(page_insert_pa(kern_pgdir, pa1, va + PGSIZE, PTE_W) == -E_INVAL);
+    // and its pages after the first can't be mapped elsewhere, unmapping
+    // them would free them on their own
+    assert(page_insert_pa(kern_pgdir, pa + 5 * PGSIZE, va + PGSIZE_PSE, PTE_W) == -E_INVAL);
+    assert(!(kern_pgdir[PDX(va + PGSIZE_PSE)] & PTE_P));
+
+    // mapped again with other permissions
+    assert(page_insert_large(kern_pgdir, pa, va, PTE_W | PTE_U) == 0);
+    assert(kern_pgdir[PDX(va)] & PTE_U);
+    assert(BUDDY_GET_REF(pages_b, pa) == 2 && page_desc(pa)->pd_mapcount == 1);
+
+    // unmapping any page of it unmaps the whole block
+    page_remove(kern_pgdir, va + 7 * PGSIZE);
+    assert(kern_pgdir[PDX(va)] == 0);
+    assert(BUDDY_GET_REF(pages_b, pa) == 1 && page_desc(pa)->pd_mapcount == 0);
+
+out:
+    pmem->decref(pa);
+    pmem->decref(pa1);
+
+    cprintf(COLOR_BLUE"check_page_large() succeeded!\n"COLOR_NONE);
+}
 
-	// free the pages we took
-	page_free(pp0);
+//
+// Check promoting pages mapped one at a time, and demoting them again.
+//
+static void check_page_promote()
+{
+    static physaddr_t pas[NPTENTRIES];
+    uint32_t tables, end, nfree, i;
+    char *va = (char *) (3 * PGSIZE_PSE);
+    pde_t *pde = &kern_pgdir[PDX(va)];
+    physaddr_t pa;
+
+    if (!use_pse)
+        return;
+
+    end = page_init_hold();
+    // page_promote() keeps it full
+    pt_reserve_fill();
+    tables = owner_pages[OWNER_PGTABLE];
+    page_mag_drain(this_page_mag(), 0);
+    nfree = buddy_nfree() + zero_pool.count;
+
+    // the largest blocks come first
+    assert(kmalloc_bulk(pas, NPTENTRIES, 0) == NPTENTRIES);
+    assert(PGOFF_PSE(pas[0]) == 0);
+    for (i = 0; i < NPTENTRIES; i++) {
+        assert(pas[i] == pas[0] + i * PGSIZE);
+        assert(page_insert_pa(kern_pgdir, pas[i], va + i * PGSIZE,
+                    i == 5 ? PTE_W : PTE_W | PTE_U) == 0);
+    }
+    assert(owner_pages[OWNER_PGTABLE] == tables + 1);
+
+    // all the permissions must be the same
+    assert(page_promote(kern_pgdir, va) == -E_INVAL);
+    assert(page_insert_pa(kern_pgdir, pas[5], va + 5 * PGSIZE, PTE_W | PTE_U) == 0);
+    assert(page_promote(kern_pgdir, va) == 0);
+    assert(*pde == (pas[0] | PTE_PS | PDE_PROMOTED | PTE_W | PTE_U | PTE_P));
+    // the page table went back
+    assert(owner_pages[OWNER_PGTABLE] == tables && pt_reserved == PT_RESERVE);
+    assert(page_promote(kern_pgdir, va) == -E_INVAL);
+
+    // the small pages are still there
+    assert(page_lookup_pa(kern_pgdir, va + 9 * PGSIZE, NULL) == pas[9]);
+    assert(check_va2pa(kern_pgdir, (uintptr_t) va + 9 * PGSIZE) == pas[9]);
+    for (i = 0; i < NPTENTRIES; i++)
+        assert(BUDDY_GET_REF(pages_b, pas[i]) == 1 && page_desc(pas[i])->pd_mapcount == 1);
+    // and not a large page to page_insert_large()
+    assert(page_insert_large(kern_pgdir, pas[0], va, PTE_W) == -E_INVAL);
+
+    // changing a page demotes it
+    assert(page_insert_pa(kern_pgdir, pas[5], va + 5 * PGSIZE, PTE_W) == 0);
+    assert(!(*pde & PTE_PS) && owner_pages[OWNER_PGTABLE] == tables + 1);
+    assert(!(*pgdir_walk(kern_pgdir, va + 5 * PGSIZE, 0) & PTE_U));
+    assert(*pgdir_walk(kern_pgdir, va + 6 * PGSIZE, 0) & PTE_U);
+    assert(check_va2pa(kern_pgdir, (uintptr_t) va + 9 * PGSIZE) == pas[9]);
+
+    // but not out of memory
+    assert(page_insert_pa(kern_pgdir, pas[5], va + 5 * PGSIZE, PTE_W | PTE_U) == 0);
+    assert(page_promote(kern_pgdir, va) == 0);
+    assert(owner_pages[OWNER_PGTABLE] == tables);
+    uint32_t t0 = buddy_steal();
+    assert(page_insert_pa(kern_pgdir, pas[5], va + 5 * PGSIZE, PTE_W) == -E_NO_MEM);
+    assert(page_demote(kern_pgdir, va) == -E_NO_MEM);
+    assert(*pde == (pas[0] | PTE_PS | PDE_PROMOTED | PTE_W | PTE_U | PTE_P));
+
+    // unmapping one takes a page table from the reserve then
+    page_remove(kern_pgdir, va + 7 * PGSIZE);
+    buddy_give_back(t0);
+    assert(!(*pde & PTE_PS) && pt_reserved == PT_RESERVE - 1);
+    assert(owner_pages[OWNER_PGTABLE] == tables);
+    assert(check_va2pa(kern_pgdir, (uintptr_t) va + 7 * PGSIZE) == ~0);
+    assert(check_va2pa(kern_pgdir, (uintptr_t) va + 8 * PGSIZE) == pas[8]);
+    assert(BUDDY_GET_REF(pages_b, pas[7]) == 0);
+    assert(page_promote(kern_pgdir, va) == -E_INVAL);
+    for (i = 0; i < NPTENTRIES; i++)
+        page_remove(kern_pgdir, va + i * PGSIZE);
+
+    // a block mapped by page_insert_large() splits into single pages
+    assert(page_promote(kern_pgdir, va) == -E_INVAL);
+    assert((pa = kmalloc(PGSIZE_PSE / PGSIZE)) != OUT_OF_MEM);
+    assert(page_insert_large(kern_pgdir, pa, va, PTE_W) == 0);
+    // the one from the reserve is gone too
+    assert(owner_pages[OWNER_PGTABLE] == tables - 1);
+    assert(page_insert_pa(kern_pgdir, pa + 3 * PGSIZE, va + 3 * PGSIZE, PTE_W | PTE_U) == 0);
+    assert(!(*pde & PTE_PS));
+    for (i = 0; i < NPTENTRIES; i++) {
+        assert(buddy_is_single(pa + i * PGSIZE));
+        assert(BUDDY_GET_REF(pages_b, pa + i * PGSIZE) == 1);
+        assert(check_va2pa(kern_pgdir, (uintptr_t) va + i * PGSIZE) == pa + i * PGSIZE);
+        page_remove(kern_pgdir, va + i * PGSIZE);
+    }
 
-	cprintf(COLOR_BLUE"check_page_installed_pgdir() succeeded!\n"COLOR_NONE);
+    // every page went back
+    pa = PTE_ADDR(*pde);
+    *pde = 0;
+    pmem->decref(pa);
+    pt_reserve_fill();
+    assert(owner_pages[OWNER_PGTABLE] == tables);
+    page_mag_drain(this_page_mag(), 0);
+    assert(buddy_nfree() + zero_pool.count == nfree);
+    page_init_release(end);
+
+    cprintf(COLOR_BLUE"check_page_promote() succeeded!\n"COLOR_NONE);
 }
 
-static void check_page_installed_pgdir_b()
+//
+// Check mapping the zero page and copying it on write.
+//
+static void check_zero_page()
 {
-	physaddr_t pa, pa0, pa1, pa2;
-        uint32_t t0;
-	pte_t *ptep, *ptep1;
-	uintptr_t va;
-	int i;
+    uint32_t user = owner_pages[OWNER_USER], end, nfree, refs, i;
+    char *va = (char *) (4 * PGSIZE_PSE);
+    physaddr_t pa, zp = zero_page;
+    pte_t *ptep;
+
+    end = page_init_hold();
+    page_mag_drain(this_page_mag(), 0);
+    nfree = buddy_nfree() + zero_pool.count;
+
+    // the zero page is taken on first use
+    assert(page_insert_zero(kern_pgdir, va, PTE_U) == 0);
+    if (zero_page == OUT_OF_MEM) {
+        // a page of its own instead
+        assert(page_lookup_pa(kern_pgdir, va, NULL) != ADDR_UNAVAIL);
+        assert(owner_pages[OWNER_USER] == user + 1);
+        assert(page_cow_fault(kern_pgdir, va) == -E_INVAL);
+        page_remove(kern_pgdir, va);
+        goto out;
+    }
+
+    // any number of mappings cost nothing
+    refs = buddy_lookup(zero_page) - 1;
+    for (i = 1; i < 64; i++)
+        assert(page_insert_zero(kern_pgdir, va + i * PGSIZE, PTE_W | PTE_U) == 0);
+    assert(buddy_lookup(zero_page) == refs + 64);
+    assert(check_va2pa(kern_pgdir, (uintptr_t) va + 5 * PGSIZE) == zero_page);
+    assert((pa = page_lookup_pa(kern_pgdir, va + 5 * PGSIZE, &ptep)) == zero_page);
+    assert(!(*ptep & PTE_W) && (*ptep & PTE_COW));
+    assert(page_desc(zero_page)->pd_mapcount == 0);
+
+    // a read-only one stays that way
+    assert(page_cow_fault(kern_pgdir, va) == -E_INVAL);
+
+    // the first write gets a zeroed page of its own
+    assert(page_cow_fault(kern_pgdir, va + 5 * PGSIZE) == 0);
+    assert((pa = page_lookup_pa(kern_pgdir, va + 5 * PGSIZE, &ptep)) != zero_page);
+    assert((*ptep & (PTE_W | PTE_U)) == (PTE_W | PTE_U) && !(*ptep & PTE_COW));
+    assert(BUDDY_GET_REF(pages_b, pa) == 1 && page_desc(pa)->pd_mapcount == 1);
+    assert(buddy_lookup(zero_page) == refs + 63);
+    assert(owner_pages[OWNER_USER] == user + 1);
+    char *c = kmap_atomic(pa);
+    for (i = 0; i < PGSIZE; i++)
+        assert(c[i] == 0);
+    kunmap_atomic(c);
+    assert(page_cow_fault(kern_pgdir, va + 5 * PGSIZE) == -E_INVAL);
+
+    // and the others still map the zero page
+    assert(check_va2pa(kern_pgdir, (uintptr_t) va + 6 * PGSIZE) == zero_page);
+    assert(page_promote(kern_pgdir, va) == -E_INVAL);
+    for (i = 0; i < 64; i++)
+        page_remove(kern_pgdir, va + i * PGSIZE);
+    assert(buddy_lookup(zero_page) == refs);
+
+    // mapping it directly doesn't make it writable either
+    assert(page_insert_pa(kern_pgdir, zero_page, va, PTE_W | PTE_U) == 0);
+    assert((ptep = pgdir_walk(kern_pgdir, va, 0)) && PTE_ADDR(*ptep) == zero_page);
+    assert(!(*ptep & PTE_W) && (*ptep & PTE_COW));
+    page_remove(kern_pgdir, va);
+    assert(buddy_lookup(zero_page) == refs);
+
+out:
+    pa = PTE_ADDR(kern_pgdir[PDX(va)]);
+    kern_pgdir[PDX(va)] = 0;
+    pmem->decref(pa);
+    assert(owner_pages[OWNER_USER] == user);
+    page_mag_drain(this_page_mag(), 0);
+    // but for the zero page, if this took it
+    assert(buddy_nfree() + zero_pool.count == nfree - (zp != zero_page));
+    page_init_release(end);
+
+    cprintf(COLOR_BLUE"check_zero_page() succeeded!\n"COLOR_NONE);
+}
+
+// check page_insert, page_remove, &c, with an installed kern_pgdir
+static void
+check_page_installed_pgdir(void)
+{
+	physaddr_t pa0, pa1, pa2;
 
 	// check that we can read and write installed pages
-	pa1 = pa2 = OUT_OF_MEM;
-	assert((pa0 = kmalloc(1)));
-	assert((pa1 = kmalloc(1)));
-	assert((pa2 = kmalloc(1)));
-	kfree(pa0);
+	assert((pa0 = pmem->alloc(0)) != OUT_OF_MEM);
+	assert((pa1 = pmem->alloc(0)) != OUT_OF_MEM);
+	assert((pa2 = pmem->alloc(0)) != OUT_OF_MEM);
+	pmem->free(pa0);
 	memset(KADDR(pa1), 1, PGSIZE);
 	memset(KADDR(pa2), 2, PGSIZE);
-	page_insert_b(kern_pgdir, pa1, (void*) PGSIZE, PTE_W);
-        assert(BUDDY_GET_REF(pages_b, pa1) == 1);
+	page_insert_pa(kern_pgdir, pa1, (void*) PGSIZE, PTE_W);
+	assert(pmem->lookup(pa1) == 1);
 	assert(*(uint32_t *)PGSIZE == 0x01010101U);
-	page_insert_b(kern_pgdir, pa2, (void*) PGSIZE, PTE_W);
+	page_insert_pa(kern_pgdir, pa2, (void*) PGSIZE, PTE_W);
 	assert(*(uint32_t *)PGSIZE == 0x02020202U);
-        assert(BUDDY_GET_REF(pages_b, pa2) == 1);
-        assert(BUDDY_GET_REF(pages_b, pa1) == 0);
+	assert(pmem->lookup(pa2) == 1);
+	assert(pmem->lookup(pa1) == 0);
 	*(uint32_t *)PGSIZE = 0x03030303U;
 	assert(*(uint32_t *)KADDR(pa2) == 0x03030303U);
-	page_remove_b(kern_pgdir, (void*) PGSIZE);
-        assert(BUDDY_GET_REF(pages_b, pa2) == 0);
+	page_remove(kern_pgdir, (void*) PGSIZE);
+	assert(pmem->lookup(pa2) == 0);
 
-	// forcibly take pa0 back
+	// forcibly take pa0 back, which frees it
 	assert(PTE_ADDR(kern_pgdir[0]) == pa0);
 	kern_pgdir[0] = 0;
-        assert(BUDDY_GET_REF(pages_b, pa0) == 1);
-        BUDDY_CLR_REF(pages_b, pa0);
-
-	// free the pages we took
-	kfree(pa0);
+	assert(pmem->lookup(pa0) == 1);
+	pmem->decref(pa0);
 
 	cprintf(COLOR_BLUE"check_page_installed_pgdir() succeeded!\n"COLOR_NONE);
 }
+
+// Check the temporary mappings. Low pages are mapped through the window at
+// KMAPBASE as if they were high, so that it runs without high memory too.
+static void
+check_kmap(void)
+{
+	physaddr_t pa0, pa1;
+	char *p0, *p1, *p2;
+	uint32_t slot;
+
+	assert((pa0 = pmem->alloc(0)) != OUT_OF_MEM);
+	assert((pa1 = pmem->alloc(0)) != OUT_OF_MEM);
+	memset(KADDR(pa0), 0xa0, PGSIZE);
+	memset(KADDR(pa1), 0xa1, PGSIZE);
+
+	// low memory needs no slot
+	assert(kmap(pa0 + 8) == (char *) KADDR(pa0) + 8);
+	kunmap(KADDR(pa0) + 8);
+	assert(kmap_atomic(pa1) == KADDR(pa1));
+	kunmap_atomic(KADDR(pa1));
+
+	// a shared slot maps the same page as KADDR()
+	p0 = kmap_high(pa0);
+	assert((uintptr_t) p0 >= KMAPBASE + KMAP_FIRST * PGSIZE);
+	assert(check_va2pa(kern_pgdir, (uintptr_t) p0) == pa0);
+	assert(p0[0] == (char) 0xa0);
+	p0[1] = 1;
+	assert(((char *) KADDR(pa0))[1] == 1);
+
+	// the same page gets the same slot, even once it's unmapped
+	slot = PGNUM((uintptr_t) p0 - KMAPBASE);
+	assert(kmap_high(pa0) == p0 && kmap_count[slot] == 2);
+	kunmap(p0);
+	kunmap(p0);
+	assert(kmap_count[slot] == 0);
+	assert(kmap_high(pa0) == p0);
+	assert((p1 = kmap_high(pa1)) != p0 && p1[0] == (char) 0xa1);
+	kunmap(p1);
+	kunmap(p0);
+
+	// atomic slots are a stack, and are flushed when reused
+	p0 = kmap_atomic_high(pa0);
+	p1 = kmap_atomic_high(pa1);
+	assert(p1 == p0 + PGSIZE);
+	assert(p0[1] == 1 && p1[1] == (char) 0xa1);
+	kunmap_atomic(p1);
+	assert((p2 = kmap_atomic_high(pa0)) == p1);
+	assert(p2[1] == 1);
+	kunmap_atomic(p2);
+	kunmap_atomic(p0);
+	assert(kmap_atomic_depth[0] == 0);
+
+	pmem->free(pa0);
+	pmem->free(pa1);
+
+	cprintf(COLOR_BLUE"check_kmap() succeeded!\n"COLOR_NONE);
+}
+
+// Check that high pages are only handed out with ALLOC_HIGH, and can be
+// mapped for users and touched through kmap() like any other page.
+static void
+check_highmem(void)
+{
+	struct Zone *high = &zones[ZONE_HIGH];
+	uint32_t nfree, i;
+	physaddr_t pa, pa_low;
+	char *p;
+
+	// the high zone may not be set up yet
+	while (!high->nfree && page_init_more())
+		/* do nothing */;
+	if (!(nfree = high->nfree))
+		return;
+
+	// the kernel's own pages stay low
+	assert((pa_low = kmalloc_page(ALLOC_ZERO)) != OUT_OF_MEM);
+	assert(PGNUM(pa_low) < npages_low && high->nfree == nfree);
+
+	// user pages come from high memory, zeroed through the window
+	assert((pa = kmalloc_page(ALLOC_HIGH | ALLOC_ZERO)) != OUT_OF_MEM);
+	assert(PGNUM(pa) >= high->lo && high->nfree == nfree - 1);
+	p = kmap(pa);
+	for (i = 0; i < PGSIZE; i++)
+		assert(p[i] == 0);
+	memset(p, 0x5a, PGSIZE);
+	kunmap(p);
+
+	// and are mapped like low ones
+	assert(kern_pgdir[0] == 0);
+	assert(page_insert_pa(kern_pgdir, pa, (void *) PGSIZE, PTE_W) == 0);
+	assert(page_lookup_pa(kern_pgdir, (void *) PGSIZE, NULL) == pa);
+	assert(pmem->lookup(pa) == 1);
+	assert(*(uint32_t *) PGSIZE == 0x5a5a5a5aU);
+
+	// the last reference gives it back to the high zone
+	page_remove(kern_pgdir, (void *) PGSIZE);
+	assert(high->nfree == nfree);
+
+	pmem->decref(PTE_ADDR(kern_pgdir[0]));
+	kern_pgdir[0] = 0;
+	kfree(pa_low);
+
+	cprintf(COLOR_BLUE"check_highmem() succeeded!\n"COLOR_NONE);
+}
@@ -12,13 +12,15 @@
 extern char bootstacktop[], bootstack[];
 
 extern struct PageInfo *pages;
+extern struct PageDesc *page_descs;
 extern size_t npages;
+extern size_t npages_low;
 
 extern pde_t *kern_pgdir;
 
 
 /* This macro takes a kernel virtual address -- an address that points above
- * KERNBASE, where the machine's maximum 256MB of physical memory is mapped --
+ * KERNBASE, where the machine's low 252MB of physical memory are mapped --
  * and returns the corresponding physical address.  It panics if you pass it a
  * non-kernel virtual address.
  */
@@ -29,45 +31,120 @@ _paddr(const char *file, int line, void *kva)
 {
 	if ((uint32_t)kva < KERNBASE)
 		_panic(file, line, "PADDR called with invalid kva %08lx", kva);
-	return (physaddr_t)kva - KERNBASE;
+	return (physaddr_t)(uintptr_t)kva - KERNBASE;
 }
 
 /* This macro takes a physical address and returns the corresponding kernel
- * virtual address.  It panics if you pass an invalid physical address. */
+ * virtual address.  It panics if you pass an invalid physical address, or
+ * one in high memory, which must be mapped with kmap() instead. */
 #define KADDR(pa) _kaddr(__FILE__, __LINE__, pa)
 
 static inline void*
 _kaddr(const char *file, int line, physaddr_t pa)
 {
-	if (PGNUM(pa) >= npages)
-		_panic(file, line, "KADDR called with invalid pa %08lx", pa);
-	return (void *)(pa + KERNBASE);
+	if (PGNUM(pa) >= npages_low)
+		_panic(file, line, "KADDR called with invalid pa %08llx", (uint64_t) pa);
+	return (void *)(uintptr_t)(pa + KERNBASE);
 }
 
 
 enum {
 	// For page_alloc, zero the returned physical page.
 	ALLOC_ZERO = 1<<0,
+	// The page may come from high memory, beyond the reach of KADDR().
+	// Good for user pages, which the kernel only touches through kmap().
+	ALLOC_HIGH = 1<<1,
 };
 
+// Who a page is allocated for, kept in its descriptor and counted by
+// page_owner_info(). Pass ALLOC_OWNER(owner) in the alloc_flags of
+// kmalloc_page(), kmalloc() and the others count as OWNER_KERNEL.
+enum {
+	OWNER_KERNEL = 0,	// kernel heap
+	OWNER_PGTABLE,		// page tables
+	OWNER_USER,		// user pages not tied to an address space
+	OWNER_BOOT,		// kernel image and boot_alloc()
+	OWNER_ENV_BASE,		// the first of the address space IDs
+	NOWNERS = 256,		// as many as pd_owner can hold
+};
+
+#define OWNER_ENV(id)		(OWNER_ENV_BASE + (id))
+#define ALLOC_OWNER(owner)	((owner) << 8)
+#define ALLOC_OWNER_OF(flags)	(((flags) >> 8) & 0xff)
+
+// In PTE_AVAIL of a page table entry: the zero page, mapped where writes
+// are allowed once it's copied, see page_cow_fault()
+#define PTE_COW			0x800
+
+// A physical page allocator backend. Pages are named by their physical
+// address, so that pgdir_walk() and the mapping functions work the same on
+// top of any backend, each of which keeps its own reference counts.
+struct PmemOps {
+	const char *name;
+	// Set up the allocator once memory is detected. Returns its page
+	// metadata, which is mapped read-only for users at UPAGES.
+	void *(*init)(size_t *meta_bytes);
+	physaddr_t (*alloc)(int alloc_flags);	// one page, OUT_OF_MEM if none
+	void (*free)(physaddr_t pa);		// a page without references
+	void (*incref)(physaddr_t pa);
+	void (*decref)(physaddr_t pa);		// frees the page at 0
+	uint32_t (*lookup)(physaddr_t pa);	// reference count of pa
+
+	// Optional, NULL if the backend has nothing better than alloc()
+	size_t (*alloc_bulk)(physaddr_t *pas, size_t n, int alloc_flags);
+	// Optional, more checks once kern_pgdir is installed
+	void (*check)(void);
+};
+
+#define PMEM_NAME_LEN	16
+
+extern char pmem_backend[PMEM_NAME_LEN];
+extern const struct PmemOps *pmem;
+extern size_t pmem_meta_bytes;		// of pmem's page metadata
+extern const struct PmemOps pmem_buddy, pmem_list, pmem_bitmap;
+
 void	mem_init(void);
 
 void	page_init(void);
 void    page_init_b();
+void    buddy_meta_info(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+int     page_insert_pa(pde_t *pgdir, physaddr_t pa, void *va, int perm);
+int     page_insert_large(pde_t *pgdir, physaddr_t pa, void *va, int perm);
+int     page_insert_zero(pde_t *pgdir, void *va, int perm);
+int     page_cow_fault(pde_t *pgdir, void *va);
+int     page_promote(pde_t *pgdir, void *va);
+int     page_demote(pde_t *pgdir, void *va);
 void	page_remove(pde_t *pgdir, void *va);
-void    page_remove_b(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
+physaddr_t page_lookup_pa(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
+struct PageDesc *page_desc(physaddr_t pa);
+void	page_set_owner(physaddr_t pa, int owner);
+
+physaddr_t kmalloc(size_t size);
+physaddr_t kmalloc_constrained(size_t size, physaddr_t max_pa, size_t align);
+physaddr_t kmalloc_page(int alloc_flags);
+size_t  kmalloc_bulk(physaddr_t *pas, size_t n, int alloc_flags);
+void    kfree_bulk(physaddr_t *pas, size_t n);
+void    page_zero_idle(void);
+void    page_init_idle(void);
+void    page_promote_idle(void);
+void    kfree(physaddr_t pa);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
 
+void   *kmap(physaddr_t pa);
+void    kunmap(void *va);
+void   *kmap_atomic(physaddr_t pa);
+void    kunmap_atomic(void *va);
+
 static inline physaddr_t
 page2pa(struct PageInfo *pp)
 {
-	return (pp - pages) << PGSHIFT;
+	return (physaddr_t) (pp - pages) << PGSHIFT;
 }
 
 static inline struct PageInfo*
@@ -89,5 +166,17 @@ pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
 int showmappings(uint32_t low, uint32_t high);
 int setpage(uint32_t low, uint32_t high, const char *perm);
 int memdump(uint32_t low, uint32_t size, bool phys);
+int mem_map_info(void);
+int zone_info(void);
+int buddy_info(void);
+void buddy_info_reset(void);
+int buddy_bench(void);
+int pmem_bench(void);
+int page_mag_info(void);
+int page_mag_tune(uint32_t high, uint32_t low, uint32_t batch);
+int zero_pool_info(void);
+int zero_pool_tune(uint32_t target);
+int page_owner_info(void);
+int page_promote_all(void);
 
 #endif /* !JOS_KERN_PMAP_H */
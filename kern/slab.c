@@ -0,0 +1,337 @@
+// Object caches on top of the buddy allocator, in the spirit of Bonwick's
+// slab allocator: every cache carves buddy blocks into equally sized
+// objects, tracked by a free bitmap at the beginning of each slab.
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/pmap.h>
+#include <kern/buddy.h>
+#include <kern/slab.h>
+
+// The cache of all caches, which is also the head of the list of caches
+static struct SlabCache cache_cache;
+
+// For each physical page, whether it belongs to a slab and how many pages
+// after the beginning of the slab it is, so that objects can be traced back
+// to their caches.
+static uint8_t *slab_map;
+
+#define SLAB_MAP_USED       0x80
+#define SLAB_MAP_OFFSET(m)  ((m)&0x7f)
+
+static void check_slab(void);
+
+#define SLAB_BYTES(c)       (PGSIZE << (c)->order)
+#define SLAB_WORDS(n)       (ROUNDUP((n), 32) / 32)
+#define SLAB_COLOR_STEP(c)  MAX((c)->align, CACHE_LINE)
+
+static inline size_t slab_header(uint32_t nobjs)
+{
+    return sizeof(struct Slab) + SLAB_WORDS(nobjs) * sizeof(uint32_t);
+}
+
+static inline void slab_push(struct Slab **list, struct Slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) (*list)->prev = slab;
+    *list = slab;
+}
+
+static inline void slab_unlink(struct Slab **list, struct Slab *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+}
+
+// Choose the smallest slab that holds enough objects without wasting more
+// than 1/8 of it, and compute the layout of the slab.
+static int slab_cache_setup(struct SlabCache *cache, const char *name,
+        size_t size, size_t align, void (*ctor)(void *))
+{
+    if (align < sizeof(void *)) align = sizeof(void *);
+    if (!IS_POWER_OF_2(align) || size == 0) return -E_INVAL;
+    size = ROUNDUP(size, align);
+
+    uint32_t order, nobjs = 0, used = 0;
+    for (order = 0; order <= SLAB_MAX_ORDER; order++) {
+        uint32_t bytes = PGSIZE << order;
+        nobjs = bytes > sizeof(struct Slab) ? (bytes - sizeof(struct Slab)) / size : 0;
+        while (nobjs && ROUNDUP(slab_header(nobjs), align) + nobjs * size > bytes)
+            nobjs--;
+        used = ROUNDUP(slab_header(nobjs), align) + nobjs * size;
+        if (nobjs >= 8 || (nobjs && (bytes - used) * 8 <= bytes)) break;
+    }
+    if (order > SLAB_MAX_ORDER) {
+        if (!nobjs) return -E_INVAL;
+        order = SLAB_MAX_ORDER;
+    }
+
+    memset(cache, 0, sizeof(*cache));
+    strncpy(cache->name, name, SLAB_NAME_LEN - 1);
+    cache->size = size;
+    cache->align = align;
+    cache->ctor = ctor;
+    cache->order = order;
+    cache->nobjs = nobjs;
+    cache->offset = ROUNDUP(slab_header(nobjs), align);
+    cache->ncolors = ((PGSIZE << order) - used) / SLAB_COLOR_STEP(cache) + 1;
+    return 0;
+}
+
+void slab_init(void)
+{
+    physaddr_t pa = kmalloc(ROUNDUP(npages, PGSIZE) / PGSIZE);
+    if (pa == OUT_OF_MEM)
+        panic("slab_init: out of memory");
+    slab_map = KADDR(pa);
+    memset(slab_map, 0, npages);
+
+    slab_cache_setup(&cache_cache, "slab_cache", sizeof(struct SlabCache), 0, NULL);
+    check_slab();
+}
+
+struct SlabCache *slab_cache_create(const char *name, size_t size,
+        size_t align, void (*ctor)(void *))
+{
+    // slabs are buddy blocks, slab_init() only runs on the buddy backend
+    if (!slab_map)
+        panic("slab_cache_create: no object caches without the buddy page allocator");
+
+    struct SlabCache *cache = slab_alloc(&cache_cache);
+    if (!cache) return NULL;
+
+    if (slab_cache_setup(cache, name, size, align, ctor) < 0) {
+        slab_free(&cache_cache, cache);
+        return NULL;
+    }
+
+    cache->next = cache_cache.next;
+    cache_cache.next = cache;
+    return cache;
+}
+
+// Give an empty slab back to the buddy system.
+static void slab_release(struct SlabCache *cache, struct Slab *slab)
+{
+    physaddr_t pa = PADDR(slab);
+    memset(&slab_map[PGNUM(pa)], 0, 1 << cache->order);
+    kfree(pa);
+    cache->nslabs--;
+}
+
+// Fails with -E_INVAL if there are objects still in use.
+int slab_cache_destroy(struct SlabCache *cache)
+{
+    if (cache->nactive) return -E_INVAL;
+    assert(!cache->partial && !cache->full);
+
+    if (cache->empty)
+        slab_release(cache, cache->empty);
+
+    struct SlabCache **pp;
+    for (pp = &cache_cache.next; *pp != cache; pp = &(*pp)->next)
+        assert(*pp);
+    *pp = cache->next;
+
+    slab_free(&cache_cache, cache);
+    return 0;
+}
+
+// Get a new slab from the buddy system, with all objects constructed.
+static struct Slab *slab_grow(struct SlabCache *cache)
+{
+    physaddr_t pa = kmalloc(1 << cache->order);
+    if (pa == OUT_OF_MEM) return NULL;
+
+    struct Slab *slab = KADDR(pa);
+    slab->cache = cache;
+    slab->inuse = 0;
+
+    uint32_t i;
+    for (i = 0; i < 1 << cache->order; i++)
+        slab_map[PGNUM(pa) + i] = SLAB_MAP_USED | i;
+
+    // Start objects of consecutive slabs on different cache lines
+    slab->objs = (char *) slab + cache->offset + cache->color * SLAB_COLOR_STEP(cache);
+    cache->color = (cache->color + 1) % cache->ncolors;
+
+    memset(slab->bitmap, 0xff, SLAB_WORDS(cache->nobjs) * sizeof(uint32_t));
+    if (cache->nobjs % 32)
+        slab->bitmap[cache->nobjs / 32] = (1 << (cache->nobjs % 32)) - 1;
+
+    if (cache->ctor)
+        for (i = 0; i < cache->nobjs; i++)
+            cache->ctor(slab->objs + i * cache->size);
+
+    cache->nslabs++;
+    return slab;
+}
+
+void *slab_alloc(struct SlabCache *cache)
+{
+    struct Slab *slab = cache->partial;
+
+    if (!slab) {
+        slab = cache->empty;
+        if (slab)
+            cache->empty = NULL;
+        else if (!(slab = slab_grow(cache)))
+            return NULL;
+        slab_push(&cache->partial, slab);
+    }
+
+    uint32_t i, bit;
+    for (i = 0; !slab->bitmap[i]; i++)
+        /* do nothing */;
+    bit = __builtin_ctz(slab->bitmap[i]);
+    slab->bitmap[i] &= ~(1 << bit);
+
+    if (++slab->inuse == cache->nobjs) {
+        slab_unlink(&cache->partial, slab);
+        slab_push(&cache->full, slab);
+    }
+    cache->nactive++;
+
+    return slab->objs + (i * 32 + bit) * cache->size;
+}
+
+void slab_free(struct SlabCache *cache, void *obj)
+{
+    struct Slab *slab = ROUNDDOWN(obj, SLAB_BYTES(cache));
+    assert(slab->cache == cache);
+
+    uint32_t off = (char *) obj - slab->objs;
+    uint32_t i = off / cache->size;
+    assert(off % cache->size == 0 && i < cache->nobjs);
+    assert(!(slab->bitmap[i / 32] & (1 << (i % 32)))); // double free
+
+    slab->bitmap[i / 32] |= 1 << (i % 32);
+    cache->nactive--;
+
+    if (slab->inuse-- == cache->nobjs) {
+        slab_unlink(&cache->full, slab);
+        slab_push(&cache->partial, slab);
+    }
+    if (slab->inuse) return;
+
+    // Keep one empty slab, give the others back
+    slab_unlink(&cache->partial, slab);
+    if (cache->empty)
+        slab_release(cache, slab);
+    else
+        cache->empty = slab;
+}
+
+// Which cache does obj come from? NULL if it's not in any slab.
+struct SlabCache *slab_cache_of(void *obj)
+{
+    uint32_t pn = PGNUM(PADDR(obj));
+    if (pn >= npages || !(slab_map[pn] & SLAB_MAP_USED))
+        return NULL;
+
+    struct Slab *slab = KADDR((pn - SLAB_MAP_OFFSET(slab_map[pn])) << PGSHIFT);
+    return slab->cache;
+}
+
+int slab_info(void)
+{
+    struct SlabCache *cache;
+
+    if (!slab_map) {
+        cprintf("The object caches need the buddy page allocator\n");
+        return 0;
+    }
+
+    cprintf("cache              size  objs/slab  pages/slab   active    total  slabs  util\n");
+    for (cache = &cache_cache; cache; cache = cache->next) {
+        uint32_t total = cache->nslabs * cache->nobjs;
+        uint32_t bytes = cache->nslabs * SLAB_BYTES(cache);
+        cprintf("%-16s %6u %10u %11u %8u %8u %6u  %3u%%\n",
+                cache->name, cache->size, cache->nobjs, 1 << cache->order,
+                cache->nactive, total, cache->nslabs,
+                bytes ? (uint32_t)((uint64_t)cache->nactive * cache->size * 100 / bytes) : 0);
+    }
+    return 0;
+}
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+#define SLAB_MAGIC  0x5ab5ab00
+
+static void check_slab_ctor(void *obj)
+{
+    *(uint32_t *) obj = SLAB_MAGIC;
+}
+
+static void check_slab(void)
+{
+    static char *objs[512];
+    struct SlabCache *cache;
+    uint32_t i, n;
+
+    assert((cache = slab_cache_create("check", 120, 8, check_slab_ctor)));
+    assert(cache->size == 120 && cache->order == 0);
+    assert(cache->nobjs >= 8 && cache->ncolors > 1);
+    assert(slab_cache_of(cache) == &cache_cache);
+
+    // fill a few slabs, and one object more
+    n = cache->nobjs * 3 + 1;
+    assert(n <= 512);
+    for (i = 0; i < n; i++) {
+        assert((objs[i] = slab_alloc(cache)));
+        assert((uint32_t) objs[i] % 8 == 0);
+        assert(*(uint32_t *) objs[i] == SLAB_MAGIC);
+        ((uint32_t *) objs[i])[1] = i;
+    }
+    assert(cache->nslabs == 4 && cache->nactive == n);
+    assert(cache->full && cache->partial && !cache->empty);
+
+    // nobody else should have touched our objects
+    for (i = 0; i < n; i++)
+        assert(((uint32_t *) objs[i])[1] == i);
+
+    // consecutive slabs are colored differently
+    uint32_t off0 = PGOFF(objs[0]);
+    uint32_t off1 = PGOFF(objs[cache->nobjs]);
+    assert(off0 != off1 && (off0 - off1) % CACHE_LINE == 0);
+
+    // the slab holding objs[0] is now partial, and will be used first
+    slab_free(cache, objs[0]);
+    assert(slab_alloc(cache) == objs[0]);
+
+    // a cache with objects in use can't be destroyed
+    assert(slab_cache_destroy(cache) < 0);
+
+    for (i = 0; i < n; i++)
+        slab_free(cache, objs[i]);
+    assert(cache->nactive == 0);
+    assert(cache->nslabs == 1 && cache->empty);
+    assert(!cache->full && !cache->partial);
+    assert(slab_cache_of(objs[n - 1]) == NULL);
+
+    // objects larger than a page go to multi-page slabs
+    struct SlabCache *big;
+    assert((big = slab_cache_create("check_big", 3000, 0, NULL)));
+    assert(big->order > 0 && big->nobjs >= 2);
+    assert((objs[0] = slab_alloc(big)));
+    assert((objs[1] = slab_alloc(big)));
+    assert(objs[0] != objs[1]);
+    assert(slab_cache_of(objs[1] + big->size - 1) == big);
+    slab_free(big, objs[1]);
+    slab_free(big, objs[0]);
+
+    assert(slab_cache_destroy(big) == 0);
+    assert(slab_cache_destroy(cache) == 0);
+
+    cprintf(COLOR_BLUE"check_slab() succeeded!\n"COLOR_NONE);
+}
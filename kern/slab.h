@@ -0,0 +1,57 @@
+#ifndef JOS_KERN_SLAB_H
+#define JOS_KERN_SLAB_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#define SLAB_NAME_LEN   16
+#define SLAB_MAX_ORDER  3   // at most 8 pages per slab
+#define CACHE_LINE      64
+
+// A slab is a buddy block of 2^order pages, beginning with this header and
+// a bitmap of its free objects, followed by the objects themselves.
+struct Slab {
+    struct SlabCache *cache;
+    struct Slab *prev;
+    struct Slab *next;
+    char *objs;         // first object, after the color offset
+    uint32_t inuse;
+    uint32_t bitmap[];  // 1 for free objects
+};
+
+// Objects of one size and alignment, constructed once when their slab is
+// created, so callers should free them in the constructed state.
+struct SlabCache {
+    char name[SLAB_NAME_LEN];
+    size_t size;        // object size, rounded up to align
+    size_t align;
+    void (*ctor)(void *obj);
+
+    uint32_t order;     // each slab is 2^order pages
+    uint32_t nobjs;     // objects per slab
+    uint32_t offset;    // first object of an uncolored slab
+    uint32_t ncolors;   // different offsets, CACHE_LINE apart
+    uint32_t color;     // color of the next slab
+
+    struct Slab *partial;
+    struct Slab *full;
+    struct Slab *empty; // at most one kept to avoid thrashing
+
+    uint32_t nslabs;
+    uint32_t nactive;   // objects in use
+
+    struct SlabCache *next;
+};
+
+void    slab_init(void);
+struct SlabCache *slab_cache_create(const char *name, size_t size,
+        size_t align, void (*ctor)(void *));
+int     slab_cache_destroy(struct SlabCache *cache);
+void   *slab_alloc(struct SlabCache *cache);
+void    slab_free(struct SlabCache *cache, void *obj);
+struct SlabCache *slab_cache_of(void *obj);
+int     slab_info(void);
+
+#endif /* !JOS_KERN_SLAB_H */